@@ -38,6 +38,9 @@ public:
 
 	const cl_mem getMem() const noexcept { return mem; }
 
+	// number of elements (of type T)
+	size_t size() const noexcept { return n; }
+
 	~ClArray()
 	{
 		if(CL_SUCCESS!=clReleaseMemObject(mem))
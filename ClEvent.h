@@ -0,0 +1,110 @@
+/*
+ * ClEvent.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: tugrul
+ */
+
+#ifndef CLEVENT_H_
+#define CLEVENT_H_
+
+#include<mutex>
+#include<condition_variable>
+#include<atomic>
+#include<thread>
+#include<stdexcept>
+#include<CL/cl.h>
+
+// waits for completion of opencl commands without keeping a core busy
+// first polls event status (with yield) for a number of times, then sleeps on a condition variable until
+// the event callback of opencl runtime wakes it up
+// short transfers complete within spin phase, long transfers (or many waiting threads) leave cores to threads that hit cache
+class ClEventWaiter
+{
+public:
+	// number of status polls before blocking (process-wide)
+	// 0 = block immediately, higher values = lower wake-up latency but more cpu usage per waiting thread
+	static void setSpinCount(const int spinCount) noexcept
+	{
+		spinCountSetting().store(spinCount<0?0:spinCount,std::memory_order_relaxed);
+	}
+
+	static int getSpinCount() noexcept
+	{
+		return spinCountSetting().load(std::memory_order_relaxed);
+	}
+
+	// returns when command of evt is complete, releases evt
+	// errorMessage: exception message when opencl reports an error for the event
+	static void waitAndRelease(cl_event evt, const char * errorMessage)
+	{
+		const cl_event_info evtInf = CL_EVENT_COMMAND_EXECUTION_STATUS;
+		cl_int evtStatus0 = CL_QUEUED;
+		const int spinCount = getSpinCount();
+		for(int i=0;i<spinCount;i++)
+		{
+			if(CL_SUCCESS != clGetEventInfo(evt, evtInf,sizeof(cl_int), &evtStatus0, nullptr))
+			{
+				clReleaseEvent(evt);
+				throw std::invalid_argument(errorMessage);
+			}
+
+			if(evtStatus0 <= CL_COMPLETE)
+			{
+				break;
+			}
+			std::this_thread::yield();
+		}
+
+		if(evtStatus0 > CL_COMPLETE)
+		{
+			// once callback is registered, it has to be waited for even if command completes in the meantime
+			// because it writes to this stack frame
+			Completion completion;
+			if(CL_SUCCESS != clSetEventCallback(evt, CL_COMPLETE, &ClEventWaiter::onComplete, &completion))
+			{
+				clReleaseEvent(evt);
+				throw std::invalid_argument(errorMessage);
+			}
+
+			std::unique_lock<std::mutex> lock(completion.m);
+			completion.cv.wait(lock,[&](){ return completion.done; });
+			evtStatus0 = completion.status;
+		}
+
+		clReleaseEvent(evt);
+		if(evtStatus0 < CL_COMPLETE)
+		{
+			throw std::invalid_argument(errorMessage);
+		}
+	}
+
+private:
+	struct Completion
+	{
+		std::mutex m;
+		std::condition_variable cv;
+		bool done = false;
+		cl_int status = CL_COMPLETE;
+	};
+
+	static void CL_CALLBACK onComplete(cl_event /* evt */, cl_int status, void * userData)
+	{
+		Completion * const completion = reinterpret_cast<Completion *>(userData);
+		std::unique_lock<std::mutex> lock(completion->m);
+		completion->status = status;
+		completion->done = true;
+		completion->cv.notify_one();
+	}
+
+	static std::atomic<int> & spinCountSetting() noexcept
+	{
+		static std::atomic<int> spinCount{DEFAULT_SPIN_COUNT};
+		return spinCount;
+	}
+
+	static constexpr int DEFAULT_SPIN_COUNT = 64;
+};
+
+
+#endif /* CLEVENT_H_ */
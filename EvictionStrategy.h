@@ -0,0 +1,675 @@
+/*
+ * EvictionStrategy.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: tugrul
+ */
+
+#ifndef EVICTIONSTRATEGY_H_
+#define EVICTIONSTRATEGY_H_
+
+#include<vector>
+#include<memory>
+#include<stdexcept>
+#include<algorithm>
+#include<atomic>
+#include<functional>
+#include"PageTable.h"
+
+// page replacement algorithm of a Cache (one instance per virtual gpu)
+// Clock2Hand: CLOCK with 2 hands (default), least book-keeping, scans flush hot pages
+// Lru: least recently used, exact recency order
+// Arc: adaptive replacement cache, balances recency and frequency by ghost hits, scan-resistant
+// TwoQueue: 2Q, new pages go through a small FIFO before entering LRU, scan-resistant
+// S3Fifo: small FIFO + main FIFO + ghost FIFO, one-hit-wonders are evicted early, scan-resistant
+enum EvictionPolicy
+{
+	Clock2Hand=0,
+	Lru=1,
+	Arc=2,
+	TwoQueue=3,
+	S3Fifo=4
+};
+
+// a cache slot (active page) is only referred by its index in [0,numSlots)
+// every slot always holds a page, so a miss first picks a victim slot then the new page is inserted into same slot
+class EvictionStrategy
+{
+public:
+	// slot was accessed and page was found in it
+	virtual void hit(const unsigned int slot) noexcept = 0;
+
+	// same as hit but called by concurrent readers that only hold a shared lock (only sharedHit calls run at the same time)
+	// returns false without recording anything when the hit needs exclusive access (list reordering), caller then retries with hit()
+	virtual bool sharedHit(const unsigned int /* slot */) noexcept { return false; }
+
+	static constexpr unsigned int NO_VICTIM = PageTable::EMPTY;
+
+	// picks the slot to be overwritten by missed page
+	// ghostHit: set to true when missed page was evicted recently (strategy still remembers it), passed to insert() of same page
+	// evictable: when not empty and it rejects the picked slot, NO_VICTIM is returned and nothing is evicted
+	//		(eviction order and ghosts stay same, only aging done by the search itself remains)
+	// several victims can be picked before their inserts (read-ahead)
+	virtual unsigned int victim(const size_t missedPage, bool & ghostHit, const std::function<bool(const unsigned int)> & evictable) = 0;
+
+	// slot leaves eviction order (pinned page), victim() does not return it until insert() is called for it again
+	// no hit()/sharedHit() calls are made for it in between
+	virtual void remove(const unsigned int slot) noexcept = 0;
+
+	// missed page is loaded into slot (also used for initial filling of cache, without victim call)
+	// ghostHit: what victim() reported for page, false when there was no victim call
+	virtual void insert(const unsigned int slot, const size_t page, const bool ghostHit) = 0;
+
+	virtual ~EvictionStrategy(){}
+};
+
+// doubly-linked lists of nodes in a fixed pool, without allocation
+// each node is in at most one list, lists share prev/next arrays of pool
+class NodeList
+{
+public:
+	static constexpr unsigned int NONE = PageTable::EMPTY;
+
+	NodeList():head(NONE),tail(NONE),n(0){}
+
+	// inserts to head (most recent)
+	void pushFront(const unsigned int node, std::vector<unsigned int> & prev, std::vector<unsigned int> & next) noexcept
+	{
+		prev[node]=NONE;
+		next[node]=head;
+		if(head!=NONE)
+		{
+			prev[head]=node;
+		}
+		head=node;
+		if(tail==NONE)
+		{
+			tail=node;
+		}
+		n++;
+	}
+
+	void remove(const unsigned int node, std::vector<unsigned int> & prev, std::vector<unsigned int> & next) noexcept
+	{
+		if(prev[node]!=NONE)
+		{
+			next[prev[node]]=next[node];
+		}
+		else
+		{
+			head=next[node];
+		}
+
+		if(next[node]!=NONE)
+		{
+			prev[next[node]]=prev[node];
+		}
+		else
+		{
+			tail=prev[node];
+		}
+		n--;
+	}
+
+	unsigned int back() const noexcept { return tail; }
+	size_t size() const noexcept { return n; }
+	bool empty() const noexcept { return n==0; }
+private:
+	unsigned int head;
+	unsigned int tail;
+	size_t n;
+};
+
+// fixed-capacity pool of ghost entries (recently evicted page indices)
+// ghost lists only remember page indices, not data
+class GhostPool
+{
+public:
+	GhostPool(){}
+	GhostPool(const size_t numPages, const size_t capacity)
+	{
+		lookup = PageTable(numPages,capacity);
+		page.resize(capacity,0);
+		list.resize(capacity,0);
+		prev.resize(capacity,NodeList::NONE);
+		next.resize(capacity,NodeList::NONE);
+		for(size_t i=0;i<capacity;i++)
+		{
+			freeNodes.push_back(capacity-1-i);
+		}
+	}
+
+	// returns ghost list id of page or -1
+	int find(const size_t p) const noexcept
+	{
+		const unsigned int node = lookup.find(p);
+		return (node==PageTable::EMPTY)?-1:list[node];
+	}
+
+	// adds page to head of a ghost list, drops the oldest entry of same list when pool is exhausted
+	void push(const size_t p, const int listId, NodeList & l)
+	{
+		if(freeNodes.empty())
+		{
+			dropBack(l);
+			if(freeNodes.empty())
+			{
+				return;
+			}
+		}
+		const unsigned int node = freeNodes.back();
+		freeNodes.pop_back();
+		page[node]=p;
+		list[node]=listId;
+		lookup.insert(p,node);
+		l.pushFront(node,prev,next);
+	}
+
+	// removes page from its ghost list
+	void erase(const size_t p, NodeList & l)
+	{
+		const unsigned int node = lookup.find(p);
+		if(node==PageTable::EMPTY)
+		{
+			return;
+		}
+		l.remove(node,prev,next);
+		lookup.erase(p);
+		freeNodes.push_back(node);
+	}
+
+	// removes oldest entry of a ghost list
+	void dropBack(NodeList & l)
+	{
+		if(l.empty())
+		{
+			return;
+		}
+		erase(page[l.back()],l);
+	}
+
+	size_t capacity() const noexcept { return page.size(); }
+private:
+	PageTable lookup;
+	std::vector<size_t> page;
+	std::vector<int> list;
+	std::vector<unsigned int> prev;
+	std::vector<unsigned int> next;
+	std::vector<unsigned int> freeNodes;
+};
+
+// CLOCK algorithm with 2 hand counters
+// first hand clears "used" bits, second hand (half a cycle behind) evicts the first slot found with a cleared bit
+class Clock2HandStrategy: public EvictionStrategy
+{
+public:
+	Clock2HandStrategy(const size_t numSlots):size(numSlots),ctr(0),ctrEvict(numSlots/2),usageUsed(numSlots)
+	{
+		// slots take part after their first insert
+		for(size_t i=0;i<size;i++)
+		{
+			usageUsed[i].store(REMOVED,std::memory_order_relaxed);
+		}
+	}
+
+	void hit(const unsigned int slot) noexcept override
+	{
+		usageUsed[slot].store(1,std::memory_order_relaxed);
+	}
+
+	// concurrent readers only set same bit
+	bool sharedHit(const unsigned int slot) noexcept override
+	{
+		usageUsed[slot].store(1,std::memory_order_relaxed);
+		return true;
+	}
+
+	unsigned int victim(const size_t /* missedPage */, bool & ghostHit, const std::function<bool(const unsigned int)> & evictable) override
+	{
+		ghostHit = false;
+		int ctrFound = -1;
+		while(ctrFound==-1)
+		{
+			if(usageUsed[ctr].load(std::memory_order_relaxed)==1)
+			{
+				usageUsed[ctr].store(0,std::memory_order_relaxed);
+			}
+
+			ctr++;
+			if(ctr>=size)
+			{
+				ctr=0;
+			}
+
+			if(usageUsed[ctrEvict].load(std::memory_order_relaxed)==0)
+			{
+				ctrFound=ctrEvict;
+			}
+
+			ctrEvict++;
+			if(ctrEvict>=size)
+			{
+				ctrEvict=0;
+			}
+		}
+
+		if(evictable && !evictable(ctrFound))
+		{
+			// second hand stays on it, it is next victim
+			ctrEvict = ctrFound;
+			return NO_VICTIM;
+		}
+
+		// out of eviction order until its new page is inserted
+		usageUsed[ctrFound].store(REMOVED,std::memory_order_relaxed);
+		return ctrFound;
+	}
+
+	void insert(const unsigned int slot, const size_t /* page */, const bool /* ghostHit */) override
+	{
+		usageUsed[slot].store(0,std::memory_order_relaxed);
+	}
+
+	// neither hand changes a removed slot
+	void remove(const unsigned int slot) noexcept override
+	{
+		usageUsed[slot].store(REMOVED,std::memory_order_relaxed);
+	}
+private:
+	static constexpr unsigned char REMOVED=2;
+
+	size_t size;
+	unsigned int ctr;
+	unsigned int ctrEvict;
+	std::vector<std::atomic<unsigned char>> usageUsed;
+};
+
+// least recently used
+class LruStrategy: public EvictionStrategy
+{
+public:
+	LruStrategy(const size_t numSlots)
+	{
+		prev.resize(numSlots,NodeList::NONE);
+		next.resize(numSlots,NodeList::NONE);
+	}
+
+	void hit(const unsigned int slot) noexcept override
+	{
+		recency.remove(slot,prev,next);
+		recency.pushFront(slot,prev,next);
+	}
+
+	unsigned int victim(const size_t /* missedPage */, bool & ghostHit, const std::function<bool(const unsigned int)> & evictable) override
+	{
+		ghostHit = false;
+		const unsigned int slot = recency.back();
+		if(evictable && !evictable(slot))
+		{
+			return NO_VICTIM;
+		}
+		recency.remove(slot,prev,next);
+		return slot;
+	}
+
+	void insert(const unsigned int slot, const size_t /* page */, const bool /* ghostHit */) override
+	{
+		recency.pushFront(slot,prev,next);
+	}
+
+	void remove(const unsigned int slot) noexcept override
+	{
+		recency.remove(slot,prev,next);
+	}
+private:
+	NodeList recency;
+	std::vector<unsigned int> prev;
+	std::vector<unsigned int> next;
+};
+
+// adaptive replacement cache (Megiddo & Modha)
+// T1: pages seen once recently, T2: pages seen at least twice recently
+// B1/B2: ghosts of pages evicted from T1/T2, a ghost hit moves target size of T1 (p) towards the list that would have kept the page
+class ArcStrategy: public EvictionStrategy
+{
+public:
+	ArcStrategy(const size_t numSlots, const size_t numPages):c(numSlots),p(0)
+	{
+		prev.resize(c,NodeList::NONE);
+		next.resize(c,NodeList::NONE);
+		inT2.resize(c,0);
+		slotPage.resize(c,0);
+		ghost = GhostPool(numPages,c);
+	}
+
+	void hit(const unsigned int slot) noexcept override
+	{
+		listOf(slot).remove(slot,prev,next);
+		t2.pushFront(slot,prev,next);
+		inT2[slot]=1;
+	}
+
+	unsigned int victim(const size_t missedPage, bool & ghostHit, const std::function<bool(const unsigned int)> & evictable) override
+	{
+		const int ghostList = ghost.find(missedPage);
+
+		// target size of T1 after this miss
+		size_t target = p;
+		if(ghostList==B1)
+		{
+			const size_t delta = std::max((size_t)1,b2.size()/std::max((size_t)1,b1.size()));
+			target = std::min(c,p+delta);
+		}
+		else if(ghostList==B2)
+		{
+			const size_t delta = std::max((size_t)1,b1.size()/std::max((size_t)1,b2.size()));
+			target = (p>delta)?(p-delta):0;
+		}
+
+		// LRU of T1 or T2 is evicted, decided before anything changes
+		const bool fromT1 = (t1.size()>0) && ((t1.size()>target) || ((ghostList==B2) && (t1.size()==target)) || t2.empty());
+		const unsigned int slot = fromT1?t1.back():t2.back();
+		if(evictable && !evictable(slot))
+		{
+			ghostHit = false;
+			return NO_VICTIM;
+		}
+
+		ghostHit = (ghostList==B1) || (ghostList==B2);
+		p = target;
+		if(ghostHit)
+		{
+			ghost.erase(missedPage,(ghostList==B1)?b1:b2);
+		}
+		else if(t1.size()+b1.size()>=c)
+		{
+			if(t1.size()>=c)
+			{
+				// T1 holds whole cache, its LRU page is dropped without a ghost
+				t1.remove(slot,prev,next);
+				return slot;
+			}
+			ghost.dropBack(b1);
+		}
+		else if(t1.size()+t2.size()+b1.size()+b2.size()>=2*c)
+		{
+			ghost.dropBack(b2);
+		}
+		(fromT1?t1:t2).remove(slot,prev,next);
+
+		// evicted page is remembered
+		if(fromT1)
+		{
+			ghost.push(slotPage[slot],B1,b1);
+		}
+		else
+		{
+			ghost.push(slotPage[slot],B2,b2);
+		}
+		return slot;
+	}
+
+	void insert(const unsigned int slot, const size_t page, const bool ghostHit) override
+	{
+		slotPage[slot]=page;
+		if(ghostHit)
+		{
+			t2.pushFront(slot,prev,next);
+			inT2[slot]=1;
+		}
+		else
+		{
+			t1.pushFront(slot,prev,next);
+			inT2[slot]=0;
+		}
+	}
+
+	// removed page does not become a ghost
+	void remove(const unsigned int slot) noexcept override
+	{
+		listOf(slot).remove(slot,prev,next);
+	}
+private:
+	static constexpr int B1=0;
+	static constexpr int B2=1;
+
+	size_t c;
+	size_t p;
+	NodeList t1,t2,b1,b2;
+	std::vector<unsigned int> prev;
+	std::vector<unsigned int> next;
+	std::vector<char> inT2;
+	std::vector<size_t> slotPage;
+	GhostPool ghost;
+
+	NodeList & listOf(const unsigned int slot) noexcept { return inT2[slot]?t2:t1; }
+};
+
+// 2Q (Johnson & Shasha), full version
+// A1in: FIFO of pages seen once (25% of cache), A1out: ghosts of pages evicted from A1in (50% of cache)
+// Am: LRU of pages that were accessed again after leaving A1in, scans only pass through A1in
+class TwoQueueStrategy: public EvictionStrategy
+{
+public:
+	TwoQueueStrategy(const size_t numSlots, const size_t numPages)
+	{
+		kIn = std::max((size_t)1,numSlots/4);
+		prev.resize(numSlots,NodeList::NONE);
+		next.resize(numSlots,NodeList::NONE);
+		inAm.resize(numSlots,0);
+		slotPage.resize(numSlots,0);
+		ghost = GhostPool(numPages,std::max((size_t)1,numSlots/2));
+	}
+
+	void hit(const unsigned int slot) noexcept override
+	{
+		// hits in A1in are not promoted (correlated references)
+		if(inAm[slot])
+		{
+			am.remove(slot,prev,next);
+			am.pushFront(slot,prev,next);
+		}
+	}
+
+	// only hits in A1in can be recorded without exclusive access (nothing to record)
+	bool sharedHit(const unsigned int slot) noexcept override
+	{
+		return !inAm[slot];
+	}
+
+	unsigned int victim(const size_t missedPage, bool & ghostHit, const std::function<bool(const unsigned int)> & evictable) override
+	{
+		const bool fromA1in = (a1in.size()>kIn) || am.empty();
+		const unsigned int slot = fromA1in?a1in.back():am.back();
+		if(evictable && !evictable(slot))
+		{
+			ghostHit = false;
+			return NO_VICTIM;
+		}
+
+		ghostHit = (ghost.find(missedPage)==A1OUT);
+		if(ghostHit)
+		{
+			ghost.erase(missedPage,a1out);
+		}
+
+		if(fromA1in)
+		{
+			a1in.remove(slot,prev,next);
+			ghost.push(slotPage[slot],A1OUT,a1out);
+		}
+		else
+		{
+			am.remove(slot,prev,next);
+		}
+		return slot;
+	}
+
+	// page that was recently evicted from A1in goes to Am
+	void insert(const unsigned int slot, const size_t page, const bool ghostHit) override
+	{
+		slotPage[slot]=page;
+		if(ghostHit)
+		{
+			am.pushFront(slot,prev,next);
+			inAm[slot]=1;
+		}
+		else
+		{
+			a1in.pushFront(slot,prev,next);
+			inAm[slot]=0;
+		}
+	}
+
+	void remove(const unsigned int slot) noexcept override
+	{
+		(inAm[slot]?am:a1in).remove(slot,prev,next);
+	}
+private:
+	static constexpr int A1OUT=0;
+
+	size_t kIn;
+	NodeList a1in,am,a1out;
+	std::vector<unsigned int> prev;
+	std::vector<unsigned int> next;
+	std::vector<char> inAm;
+	std::vector<size_t> slotPage;
+	GhostPool ghost;
+};
+
+// S3-FIFO (Yang et al.)
+// S: small FIFO (10% of cache) for new pages, M: main FIFO, G: ghost FIFO of pages evicted from S
+// pages accessed more than once while in S move to M, others are evicted quickly (one-hit-wonders of scans)
+// M is a FIFO with reinsertion (2-bit frequency per page, similar to CLOCK)
+class S3FifoStrategy: public EvictionStrategy
+{
+public:
+	S3FifoStrategy(const size_t numSlots, const size_t numPages):freq(numSlots)
+	{
+		smallTarget = std::max((size_t)1,numSlots/10);
+		prev.resize(numSlots,NodeList::NONE);
+		next.resize(numSlots,NodeList::NONE);
+		inM.resize(numSlots,0);
+		for(size_t i=0;i<numSlots;i++)
+		{
+			freq[i].store(0,std::memory_order_relaxed);
+		}
+		slotPage.resize(numSlots,0);
+		ghost = GhostPool(numPages,numSlots);
+	}
+
+	void hit(const unsigned int slot) noexcept override
+	{
+		sharedHit(slot);
+	}
+
+	// concurrent increments may be lost, frequency is only an approximation anyway
+	bool sharedHit(const unsigned int slot) noexcept override
+	{
+		const unsigned char f = freq[slot].load(std::memory_order_relaxed);
+		if(f<3)
+		{
+			freq[slot].store(f+1,std::memory_order_relaxed);
+		}
+		return true;
+	}
+
+	// promotions and reinsertions found on the way are done even when picked slot is not evictable
+	unsigned int victim(const size_t missedPage, bool & ghostHit, const std::function<bool(const unsigned int)> & evictable) override
+	{
+		ghostHit = false;
+		while(true)
+		{
+			const bool fromS = (s.size()>=smallTarget) || m.empty();
+			const unsigned int slot = fromS?s.back():m.back();
+			const unsigned char f = freq[slot].load(std::memory_order_relaxed);
+			if(fromS && (f>1))
+			{
+				// accessed again while in S: promote
+				s.remove(slot,prev,next);
+				freq[slot].store(0,std::memory_order_relaxed);
+				m.pushFront(slot,prev,next);
+				inM[slot]=1;
+				continue;
+			}
+
+			if(!fromS && (f>0))
+			{
+				// reinsertion
+				m.remove(slot,prev,next);
+				freq[slot].store(f-1,std::memory_order_relaxed);
+				m.pushFront(slot,prev,next);
+				continue;
+			}
+
+			if(evictable && !evictable(slot))
+			{
+				return NO_VICTIM;
+			}
+
+			ghostHit = (ghost.find(missedPage)==G);
+			if(ghostHit)
+			{
+				ghost.erase(missedPage,g);
+			}
+
+			(fromS?s:m).remove(slot,prev,next);
+			if(fromS)
+			{
+				ghost.push(slotPage[slot],G,g);
+			}
+			return slot;
+		}
+	}
+
+	// page that was recently evicted from S goes to M
+	void insert(const unsigned int slot, const size_t page, const bool ghostHit) override
+	{
+		slotPage[slot]=page;
+		freq[slot].store(0,std::memory_order_relaxed);
+		if(ghostHit)
+		{
+			m.pushFront(slot,prev,next);
+			inM[slot]=1;
+		}
+		else
+		{
+			s.pushFront(slot,prev,next);
+			inM[slot]=0;
+		}
+	}
+
+	void remove(const unsigned int slot) noexcept override
+	{
+		(inM[slot]?m:s).remove(slot,prev,next);
+	}
+private:
+	static constexpr int G=0;
+
+	size_t smallTarget;
+	NodeList s,m,g;
+	std::vector<unsigned int> prev;
+	std::vector<unsigned int> next;
+	std::vector<char> inM;
+	std::vector<std::atomic<unsigned char>> freq;
+	std::vector<size_t> slotPage;
+	GhostPool ghost;
+};
+
+// numSlots: number of active pages of cache
+// numPages: number of frozen pages of virtual gpu (for ghost lookups)
+inline
+std::unique_ptr<EvictionStrategy> makeEvictionStrategy(const EvictionPolicy policy, const size_t numSlots, const size_t numPages)
+{
+	switch(policy)
+	{
+		case EvictionPolicy::Clock2Hand: return std::unique_ptr<EvictionStrategy>(new Clock2HandStrategy(numSlots));
+		case EvictionPolicy::Lru: return std::unique_ptr<EvictionStrategy>(new LruStrategy(numSlots));
+		case EvictionPolicy::Arc: return std::unique_ptr<EvictionStrategy>(new ArcStrategy(numSlots,numPages));
+		case EvictionPolicy::TwoQueue: return std::unique_ptr<EvictionStrategy>(new TwoQueueStrategy(numSlots,numPages));
+		case EvictionPolicy::S3Fifo: return std::unique_ptr<EvictionStrategy>(new S3FifoStrategy(numSlots,numPages));
+	}
+	throw std::invalid_argument("Error: unknown eviction policy");
+}
+
+#endif /* EVICTIONSTRATEGY_H_ */
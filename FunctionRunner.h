@@ -9,114 +9,392 @@
 #define FUNCTIONRUNNER_H_
 
 #include<mutex>
-#include<queue>
 #include<thread>
 #include<condition_variable>
 #include<memory>
+#include<atomic>
+#include<chrono>
+#include<vector>
+#include<functional>
+#include<cstdint>
+#include<deque>
+#include<future>
+#include<exception>
 
+// maximum number of pending prefetches per worker, requests beyond this are dropped
+constexpr size_t PREFETCH_QUEUE_CAPACITY = 256;
 
-template<typename T>
-class Prefetcher
+// a queued prefetch is dropped if it waited longer than this many (average) page loads
+constexpr long long PREFETCH_EXPIRY_LOADS = 64;
+
+// bounded lock-free queue for multiple producers and a single consumer
+// ring of cells with sequence numbers: a cell is writable when its sequence equals the enqueue position, readable when it is one more
+class PrefetchQueue
 {
 public:
-	Prefetcher(){  }
-	Prefetcher(Prefetcher & p) = default;
-	Prefetcher(T vaPrm)
-	{
-		va=vaPrm;
-		thr=std::thread([&](){
-			size_t currentIndex;
-			bool work = true;
-			while(work)
+	struct Request
+	{
+		size_t page;
+
+		// time of push, in nanoseconds of steady clock
+		long long time;
+	};
+
+	// capacity is rounded up to a power of 2
+	PrefetchQueue(const size_t capacity)
+	{
+		size_t n = 2;
+		while(n<capacity)
+		{
+			n*=2;
+		}
+		mask = n-1;
+		cell = std::unique_ptr<Cell[]>(new Cell[n]);
+		for(size_t i=0;i<n;i++)
+		{
+			cell[i].sequence.store(i,std::memory_order_relaxed);
+		}
+		enqueuePos.store(0,std::memory_order_relaxed);
+		dequeuePos=0;
+	}
+
+	// any thread, returns false when queue is full
+	bool tryPush(const Request & request) noexcept
+	{
+		size_t pos = enqueuePos.load(std::memory_order_relaxed);
+		Cell * c = nullptr;
+		while(true)
+		{
+			c = &cell[pos & mask];
+			const size_t seq = c->sequence.load(std::memory_order_acquire);
+			const long long diff = (long long)seq - (long long)pos;
+			if(diff==0)
 			{
+				if(enqueuePos.compare_exchange_weak(pos,pos+1,std::memory_order_relaxed))
 				{
-					std::unique_lock<std::mutex> lck(mut);
+					break;
+				}
+			}
+			else if(diff<0)
+			{
+				return false;
+			}
+			else
+			{
+				pos = enqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+		c->request = request;
+		c->sequence.store(pos+1,std::memory_order_release);
+		return true;
+	}
 
+	// only consumer thread, returns false when queue is empty
+	bool tryPop(Request & request) noexcept
+	{
+		Cell & c = cell[dequeuePos & mask];
+		if(c.sequence.load(std::memory_order_acquire) != dequeuePos+1)
+		{
+			return false;
+		}
+		request = c.request;
+		c.sequence.store(dequeuePos+mask+1,std::memory_order_release);
+		dequeuePos++;
+		return true;
+	}
 
-					if(!iQ.empty())
-					{
-						currentIndex = iQ.front();
-						iQ.pop();
-					}
-					else
-					{
-						cond.wait_for(lck,std::chrono::milliseconds(100));
-						continue;
-					}
-				}
+	// only consumer thread
+	bool empty() const noexcept
+	{
+		return cell[dequeuePos & mask].sequence.load(std::memory_order_acquire) != dequeuePos+1;
+	}
 
-				if(currentIndex==-1)
+private:
+	struct Cell
+	{
+		std::atomic<size_t> sequence;
+		Request request;
+	};
+
+	std::unique_ptr<Cell[]> cell;
+	size_t mask;
+	alignas(64) std::atomic<size_t> enqueuePos;
+	alignas(64) size_t dequeuePos;
+};
+
+// loads pages in background with one worker thread per channel (virtual gpu) so prefetch throughput scales with number of cards
+// page p is loaded by worker p%numWorker
+// single pages (hints): a page that is already queued is not queued again, a page that is already cached (or waited too long) is dropped by worker
+// batches: every page is loaded (or found cached) before completion is signaled, batches are served before hints
+class Prefetcher
+{
+public:
+	// numWorker: number of worker threads
+	// numPage: total number of pages (for de-duplication)
+	// load: loads a page of a batch into cache, returns false if page was already cached
+	//		called concurrently by workers, exceptions are passed to future of batch
+	// loadHint: same for single pages (hints), may load them somewhere that does not evict cached pages, exceptions are ignored
+	// queueCapacity: maximum pending prefetches per worker
+	Prefetcher(const size_t numWorker, const size_t numPage, std::function<bool(size_t)> load, std::function<bool(size_t)> loadHint,
+			const size_t queueCapacity=PREFETCH_QUEUE_CAPACITY):
+		loadPage(load),loadPageHint(loadHint),queued(new std::atomic<uint64_t>[(numPage+63)/64])
+	{
+		for(size_t i=0;i<(numPage+63)/64;i++)
+		{
+			queued[i].store(0,std::memory_order_relaxed);
+		}
+
+		for(size_t i=0;i<numWorker;i++)
+		{
+			worker.push_back(std::unique_ptr<Worker>(new Worker(queueCapacity)));
+		}
+
+		for(size_t i=0;i<numWorker;i++)
+		{
+			Worker * const w = worker[i].get();
+			w->thr = std::thread([this,w](){ run(*w); });
+		}
+	}
+
+	Prefetcher(const Prefetcher &) = delete;
+	Prefetcher & operator = (const Prefetcher &) = delete;
+
+	// queues a page for loading, returns false if it is already queued or queue of its worker is full
+	bool push(const size_t page)
+	{
+		const uint64_t bit = 1ull<<(page&63);
+		if(queued[page>>6].fetch_or(bit,std::memory_order_acq_rel) & bit)
+		{
+			return false;
+		}
+
+		Worker & w = *worker[page%worker.size()];
+		if(!w.queue.tryPush(PrefetchQueue::Request{page,now()}))
+		{
+			queued[page>>6].fetch_and(~bit,std::memory_order_acq_rel);
+			return false;
+		}
+
+		// pairs with the fence of a worker going to sleep: either worker sees the request or this sees the worker sleeping
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(w.sleeping.load(std::memory_order_relaxed))
+		{
+			std::unique_lock<std::mutex> lck(w.m);
+			w.cond.notify_one();
+		}
+		return true;
+	}
+
+	// queues all pages for loading, returned future becomes ready when every page was loaded or found cached
+	// first exception of a load is rethrown by the future
+	// destroying prefetcher before completion makes the future throw std::future_error (broken promise)
+	std::future<void> pushBatch(const std::vector<size_t> & pages)
+	{
+		std::vector<std::vector<size_t>> pagesOfWorker(worker.size());
+		for(const size_t & page:pages)
+		{
+			pagesOfWorker[page%worker.size()].push_back(page);
+		}
+
+		std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+		std::future<void> result = batch->done.get_future();
+		size_t numPart = 0;
+		for(const auto & part:pagesOfWorker)
+		{
+			numPart += !part.empty();
+		}
+
+		if(numPart==0)
+		{
+			batch->done.set_value();
+			return result;
+		}
+
+		batch->remaining.store(numPart,std::memory_order_relaxed);
+		for(size_t i=0;i<worker.size();i++)
+		{
+			if(!pagesOfWorker[i].empty())
+			{
+				Worker & w = *worker[i];
+				std::unique_lock<std::mutex> lck(w.m);
+				w.batch.emplace_back(batch,std::move(pagesOfWorker[i]));
+				w.cond.notify_one();
+			}
+		}
+		return result;
+	}
+
+	// moving average of time spent loading a page that was not cached yet, in nanoseconds, 0 = nothing loaded yet
+	long long averageLatencyNanoseconds() const noexcept
+	{
+		return latencyNs.load(std::memory_order_relaxed);
+	}
+
+	// pending prefetches are dropped
+	~Prefetcher()
+	{
+		stop.store(true,std::memory_order_seq_cst);
+		for(auto & w:worker)
+		{
+			std::unique_lock<std::mutex> lck(w->m);
+			w->cond.notify_one();
+		}
+
+		for(auto & w:worker)
+		{
+			if(w->thr.joinable())
+			{
+				w->thr.join();
+			}
+		}
+	}
+private:
+	// pages of a batch are split between workers, last worker to finish its part completes the batch
+	struct Batch
+	{
+		std::atomic<size_t> remaining;
+		std::promise<void> done;
+		std::mutex errorMut;
+		std::exception_ptr error;
+
+		void fail(std::exception_ptr e)
+		{
+			std::unique_lock<std::mutex> lck(errorMut);
+			if(!error)
+			{
+				error = e;
+			}
+		}
+
+		void finishPart()
+		{
+			if(remaining.fetch_sub(1,std::memory_order_acq_rel)==1)
+			{
+				std::unique_lock<std::mutex> lck(errorMut);
+				if(error)
 				{
-					work=false;
+					done.set_exception(error);
 				}
 				else
 				{
-					va.get(currentIndex);
+					done.set_value();
 				}
 			}
+		}
+	};
 
-			{
-				std::unique_lock<std::mutex> lck(mut);
-				while(!iQ.empty())
-				{
-					iQ.pop();
-				}
-				iQ.push(-5);
-			}
+	struct Worker
+	{
+		Worker(const size_t queueCapacity):queue(queueCapacity),sleeping(false){}
 
-		});
-	}
+		PrefetchQueue queue;
+		std::atomic<bool> sleeping;
+		std::mutex m;
+		std::condition_variable cond;
+		std::thread thr;
 
+		// guarded by m
+		std::deque<std::pair<std::shared_ptr<Batch>,std::vector<size_t>>> batch;
+	};
 
-	void push(const size_t index)
+	std::function<bool(size_t)> loadPage;
+	std::function<bool(size_t)> loadPageHint;
+	std::unique_ptr<std::atomic<uint64_t>[]> queued;
+	std::vector<std::unique_ptr<Worker>> worker;
+	std::atomic<long long> latencyNs{0};
+	std::atomic<bool> stop{false};
+
+	static long long now() noexcept
 	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// returns false if page was already cached
+	bool loadTimed(const std::function<bool(size_t)> & load, const size_t page)
+	{
+		const long long t0 = now();
+		const bool loaded = load(page);
+		if(loaded)
 		{
-			std::unique_lock<std::mutex> lck(mut);
-			iQ.push(index);
+			// approximate moving average, concurrent updates of workers may overwrite each other
+			const long long t = now() - t0;
+			const long long avg = latencyNs.load(std::memory_order_relaxed);
+			latencyNs.store((avg==0)?t:((avg*3 + t)/4),std::memory_order_relaxed);
 		}
-		cond.notify_one();
+		return loaded;
 	}
 
-	~Prefetcher()
+	void run(Worker & w)
 	{
-		push(-1);
-		bool work = true;
-
-		while(work)
+		while(!stop.load(std::memory_order_relaxed))
 		{
+			std::shared_ptr<Batch> batch;
+			std::vector<size_t> batchPages;
+			{
+				std::unique_lock<std::mutex> lck(w.m);
+				if(!w.batch.empty())
+				{
+					batch = std::move(w.batch.front().first);
+					batchPages = std::move(w.batch.front().second);
+					w.batch.pop_front();
+				}
+			}
+
+			if(batch)
 			{
-				std::unique_lock<std::mutex> lck(mut);
-				if(!iQ.empty())
+				for(const size_t & page:batchPages)
 				{
-					size_t index = iQ.front();
-					iQ.pop();
-					if(index == -5)
+					if(stop.load(std::memory_order_relaxed))
 					{
-						// close signal received
-						work=false;
+						// unfinished batch is completed as broken promise
+						return;
 					}
-					else if (index == -1)
-					{
-						iQ.push(-1);
 
+					try
+					{
+						loadTimed(loadPage,page);
+					}
+					catch(...)
+					{
+						batch->fail(std::current_exception());
 					}
 				}
+				batch->finishPart();
+				continue;
 			}
-			cond.notify_one();
-			std::this_thread::yield();
-		}
 
-		if(thr.joinable())
-			thr.join();
+			PrefetchQueue::Request request;
+			if(w.queue.tryPop(request))
+			{
+				// a new request for same page can be queued while this one is loading, it will be dropped as cached
+				queued[request.page>>6].fetch_and(~(1ull<<(request.page&63)),std::memory_order_acq_rel);
 
+				const long long avg = latencyNs.load(std::memory_order_relaxed);
+				const long long t0 = now();
+				if((avg>0) && (t0 - request.time > avg*PREFETCH_EXPIRY_LOADS))
+				{
+					// requester has most likely moved on (or loaded it on its own)
+					continue;
+				}
 
+				try
+				{
+					loadTimed(loadPageHint,request.page);
+				}
+				catch(...)
+				{
+					// prefetching is only a hint
+				}
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lck(w.m);
+			w.sleeping.store(true,std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			w.cond.wait(lck,[&](){ return stop.load(std::memory_order_relaxed) || !w.batch.empty() || !w.queue.empty(); });
+			w.sleeping.store(false,std::memory_order_relaxed);
+		}
 	}
-private:
-	std::condition_variable cond;
-	std::thread thr;
-	std::mutex mut;
-	std::queue<size_t> iQ;
-	T va;
 };
 
 
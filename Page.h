@@ -10,20 +10,28 @@
 
 #include<vector>
 #include<memory>
+#include<cstdint>
+#include<algorithm>
 #include"ClCommandQueue.h"
 #include"ClContext.h"
 #include"AlignedCpuArray.h"
 
+// dirty ranges closer than this many bytes are uploaded as one range (a transfer costs more than a few kB of extra data)
+constexpr size_t DIRTY_RANGE_MERGE_GAP_BYTES = 4096;
+
+// upper limit of partial uploads per page, more dirty ranges than this are uploaded as a single range from first to last edited element
+constexpr int DIRTY_RANGE_MAX_UPLOADS = 8;
+
 // active page that holds data in RAM by pinned buffers
 template<typename T>
 class Page
 {
 public:
 	// do not use this
-	Page(){arr=nullptr; edited=false;targetGpuPage=-1;}
+	Page(){arr=nullptr; edited=false;targetGpuPage=-1; numElm=0;}
 
 	// allocates pinned array for a "page", uses opencl way of pinning the array and is meant to be used in its own command queue
-	Page(int sz,ClContext ctxP, ClCommandQueue cqP, const bool usePinnedArraysOnly=true){ arr=std::shared_ptr<AlignedCpuArray<T>>(new AlignedCpuArray<T>(*ctxP.ctxPtr(),cqP.getQueue(),sz,4096,usePinnedArraysOnly)); edited=false; targetGpuPage=-1;}
+	Page(int sz,ClContext ctxP, ClCommandQueue cqP, const bool usePinnedArraysOnly=true){ arr=std::shared_ptr<AlignedCpuArray<T>>(new AlignedCpuArray<T>(*ctxP.ctxPtr(),cqP.getQueue(),sz,4096,usePinnedArraysOnly)); edited=false; targetGpuPage=-1; numElm=sz; dirty.resize((sz+63)/64,0);}
 
 	// reading an element of virtual array
 	// i: index of element
@@ -53,19 +61,131 @@ public:
 	}
 
 	// only copying, no allocation
-	void writeN(T * const in, const int & i, const size_t & n) const  noexcept
+	void writeN(const T * const in, const int & i, const size_t & n) const  noexcept
 	{
 		std::copy(in,in+n,arr->getArray()+i);
 	}
 
 
-	void markAsEdited()  noexcept {  edited=true;  }
+	// marks n elements starting at i as edited, only edited ranges are uploaded to graphics card
+	void markAsEdited(const int & i, const size_t & n=1)  noexcept
+	{
+		edited=true;
+		if(n==1)
+		{
+			dirty[i>>6] |= (((uint64_t)1)<<(i&63));
+			return;
+		}
+
+		const size_t end = i+n;
+		for(size_t k=i;k<end;)
+		{
+			const size_t word = k>>6;
+			const size_t bitBegin = k&63;
+			const size_t bitEnd = (((end-(k-bitBegin))<64)?(end-(k-bitBegin)):64);
+			const uint64_t mask = ((bitEnd-bitBegin)==64)?(~(uint64_t)0):(((((uint64_t)1)<<(bitEnd-bitBegin))-1)<<bitBegin);
+			dirty[word] |= mask;
+			k += bitEnd-bitBegin;
+		}
+	}
 
 	// checks if page is edited (if true, paging system will upload data to graphics card in case of a storage requirement of a different frozen page)
 	bool isEdited() const noexcept { return edited; }
 
 	// clears "edited" status, only used after getting fresh data from a frozen page
-	void reset() noexcept { edited=false; }
+	void reset() noexcept
+	{
+		if(edited)
+		{
+			std::fill(dirty.begin(),dirty.end(),0);
+		}
+		edited=false;
+	}
+
+	// calls f(first element, number of elements) for every edited range of page
+	// close ranges are merged, too many ranges are merged into one
+	template<typename F>
+	void forEachEditedRange(F f) const
+	{
+		if(!edited)
+		{
+			return;
+		}
+
+		const size_t mergeGap = ((DIRTY_RANGE_MERGE_GAP_BYTES/sizeof(T))>0)?(DIRTY_RANGE_MERGE_GAP_BYTES/sizeof(T)):1;
+		size_t rangeBegin[DIRTY_RANGE_MAX_UPLOADS];
+		size_t rangeEnd[DIRTY_RANGE_MAX_UPLOADS];
+		int numRange = 0;
+		bool overflow = false;
+		size_t first = numElm;
+		size_t last = 0;
+
+		size_t k = 0;
+		while(k<numElm)
+		{
+			const uint64_t word = dirty[k>>6];
+			if(((k&63)==0) && (word==0))
+			{
+				k+=64;
+				continue;
+			}
+
+			if(((word>>(k&63))&1)==0)
+			{
+				k++;
+				continue;
+			}
+
+			// start of an edited run
+			const size_t runBegin = k;
+			while((k<numElm) && ((dirty[k>>6]>>(k&63))&1))
+			{
+				k++;
+			}
+
+			if(first==numElm)
+			{
+				first=runBegin;
+			}
+			last=k;
+
+			if((numRange>0) && (runBegin-rangeEnd[numRange-1] <= mergeGap))
+			{
+				rangeEnd[numRange-1]=k;
+			}
+			else if(numRange<DIRTY_RANGE_MAX_UPLOADS)
+			{
+				rangeBegin[numRange]=runBegin;
+				rangeEnd[numRange]=k;
+				numRange++;
+			}
+			else
+			{
+				overflow=true;
+			}
+		}
+
+		if(overflow)
+		{
+			f(first,last-first);
+			return;
+		}
+
+		for(int r=0;r<numRange;r++)
+		{
+			f(rangeBegin[r],rangeEnd[r]-rangeBegin[r]);
+		}
+	}
+
+	// copies edited elements and edited status of another page (used for staging an evicted page)
+	void copyEdited(const Page<T> & src) noexcept
+	{
+		src.forEachEditedRange([&](const size_t b, const size_t n){
+			std::copy(src.ptr()+b,src.ptr()+b+n,ptr()+b);
+		});
+		std::copy(src.dirty.begin(),src.dirty.end(),dirty.begin());
+		edited=src.edited;
+	}
 
 	// this changes index of frozen page (in a graphics card) is being written/read
 	void setTargetGpuPage(size_t g)  noexcept { targetGpuPage=g; }
@@ -79,10 +199,15 @@ public:
 	Page<T>& operator=(Page<T>&&) = default;
 	Page<T>& operator=(Page<T>&) = default;
 	Page(Page<T>&) = default;
+	Page(Page<T>&&) = default;
 	~Page(){}
 private:
 	std::shared_ptr<AlignedCpuArray<T>> arr;
 	bool edited;// todo: should make this smart pointer too, if a different paging algorithm is going to be used
+	size_t numElm;
+
+	// 1 bit per element, set bits are uploaded on eviction/flush
+	std::vector<uint64_t> dirty;
 	size_t targetGpuPage; // todo: should make this smart pointer too, if a different paging algorithm is going to be used
 };
 
@@ -9,14 +9,19 @@
 #define PAGECACHE_H_
 
 
-/* LRU implementation */
+/* LRU implementation, page replacement algorithm is chosen by EvictionPolicy */
 #include<vector>
 #include<algorithm>
-#include<unordered_map>
 #include<list>
 #include<functional>
 #include<memory>
+#include<string>
+#include<atomic>
 #include"Page.h"
+#include"PageTable.h"
+#include"EvictionStrategy.h"
+#include"ClEvent.h"
+#include"VramSnapshot.h"
 
 
 
@@ -24,40 +29,83 @@ template<typename T>
 class Cache
 {
 public:
-	Cache():size(0),ctr(0),szp(0),gpu(nullptr),q(nullptr){ ctrEvict=0; cacheHit=0; cacheMiss=0;  fImplementation= [&](const size_t & ind){ Page<T> * result=nullptr; return result;};}
-
-
+	Cache():size(0),szp(0),gpu(nullptr),q(nullptr),qWriteBack(nullptr){ hitRatioDebugging=false; cacheHit=0; cacheMiss=0; numWriteBackPages=0; writeBackCtr=0; numWriteBackInFlight=0; pageStride=1; numPages=0; numReadAheadPages=0; numPinned=0; maxPinned=0; numStagingPages=0; stagingCtr=0; evictionPolicy=EvictionPolicy::Clock2Hand; fImplementation= [&](const size_t & ind){ Page<T> * result=nullptr; return result;};}
+
+
+	// cqWriteBack: second queue that uploads evicted edited pages in background (only used when numWriteBackPagesPrm>0)
+	// writeBackArr: staging pages that hold copies of evicted edited pages until their upload completes
+	// numWriteBackPagesPrm: number of staging pages, 0 = evictions upload edited pages synchronously before the download
+	// policy: page replacement algorithm (see EvictionStrategy.h)
+	// shardId, numShards: this cache only serves pages with index%numShards==shardId (other shards share same queue and buffer)
+	// readAheadArr: staging page of (numReadAheadPagesPrm+1) pages, receives a missed page and its next pages in one transfer
+	// numReadAheadPagesPrm: number of next pages (of this shard) to load together with a missed page
+	//		only when the previous page is cached (sequential access), 0 = every miss loads only its own page
+	// stagingArr: pages that receive speculative prefetches (stage()) without evicting anything from cache
+	// numStagingPagesPrm: number of staging pages, oldest staged page is overwritten first, 0 = stage() loads into cache
 	Cache(size_t sizePrm, std::shared_ptr<ClCommandQueue> cq, std::shared_ptr<ClArray<T>> arr,
 			int pageSize, bool usePinnedArraysOnly,
 			std::shared_ptr<Page<T>> cpuArr,
-			bool hitRatioDebuggingEnabled=false):size(sizePrm),ctr(0),szp(pageSize)
+			bool hitRatioDebuggingEnabled=false,
+			std::shared_ptr<ClCommandQueue> cqWriteBack=nullptr,
+			std::shared_ptr<Page<T>> writeBackArr=nullptr,
+			const int numWriteBackPagesPrm=0,
+			const EvictionPolicy policy=EvictionPolicy::Clock2Hand,
+			const size_t shardId=0, const size_t numShards=1,
+			std::shared_ptr<Page<T>> readAheadArr=nullptr, const int numReadAheadPagesPrm=0,
+			std::shared_ptr<Page<T>> stagingArr=nullptr, const int numStagingPagesPrm=0):size(sizePrm),szp(pageSize)
 	{
+		stagingPages=stagingArr;
+		numStagingPages=numStagingPagesPrm;
+		stagingIndex.resize(numStagingPages,NO_PAGE);
+		stagingCtr=0;
+		pageStride=numShards;
+		numPages=arr->size()/pageSize;
+		evictionPolicy=policy;
+		pageStorage.push_back(cpuArr);
+		readAheadPage=readAheadArr;
+		numReadAheadPages=numReadAheadPagesPrm;
+		readAheadSlots.reserve(numReadAheadPages+1);
+		readAheadGhostHit.reserve(numReadAheadPages+1);
+		pinned.resize(size,0);
+		numPinned=0;
+		maxPinned=maxPinnedOf(size);
+
+		hitRatioDebugging=hitRatioDebuggingEnabled;
 		cacheHit=0;
 		cacheMiss=0;
 		q=cq;
 		gpu=arr;
-		ctr=0;
-		ctrEvict=size/2;
+
+		qWriteBack=cqWriteBack;
+		writeBackPages=writeBackArr;
+		numWriteBackPages=numWriteBackPagesPrm;
+		writeBackCtr=0;
+		numWriteBackInFlight=0;
+		writeBackEvents.resize(numWriteBackPages,nullptr);
+
+		fastMapping = PageTable(gpu->size()/szp,size);
+		strategy = makeEvictionStrategy(policy,size,gpu->size()/szp);
 
 		for(int i=0;i<sizePrm;i++)
 		{
+			const size_t initialPage = i*numShards + shardId;
 			Page<T> * page = cpuArr.get()+i;
-			updatePage(page, (size_t)i);
+			updatePage(page, initialPage);
 			page->reset();
 
 			usagePagePtr.push_back(page);
-			usageIndex.push_back((size_t)i);
-			usageUsed.push_back(0);
-			fastMapping[(size_t)i]=i;
+			usageIndex.push_back(initialPage);
+			fastMapping.insert(initialPage,i);
+			strategy->insert(i,initialPage,false);
 		}
 
 		if(hitRatioDebuggingEnabled)
 		{
-			fImplementation = [&](const size_t & index ){ return accessClock2HandDebug(index);};
+			fImplementation = [&](const size_t & index ){ return accessStrategyDebug(index);};
 		}
 		else
 		{
-			fImplementation = [&](const size_t & index ){ return accessClock2Hand(index);};
+			fImplementation = [&](const size_t & index ){ return accessStrategy(index);};
 		}
 	}
 
@@ -67,244 +115,880 @@ public:
 		return fImplementation(index);
 	}
 
-	// CLOCK algorithm with 2 hand counters
-	Page<T> * const accessClock2Hand(const size_t & index)
+	// lookup for readers that hold only a shared lock of this cache (other shared readers may run concurrently)
+	// returns nullptr when page is not cached or when eviction strategy needs exclusive access to record the hit
+	// then the caller takes exclusive lock and uses access()
+	Page<T> * const accessShared(const size_t & index)
 	{
+		const unsigned int slot = fastMapping.find(index);
+		if((slot!=PageTable::EMPTY) && (pinned[slot] || strategy->sharedHit(slot)))
+		{
+			if(hitRatioDebugging)
+			{
+				cacheHit.fetch_add(1,std::memory_order_relaxed);
+			}
+			return usagePagePtr[slot];
+		}
+		return nullptr;
+	}
 
-		typename std::unordered_map<size_t,unsigned int>::iterator it = fastMapping.find(index);
-		if(it!=fastMapping.end())
+	// only lookup, no hit is recorded (safe under shared lock)
+	bool isCached(const size_t & index) const noexcept
+	{
+		return fastMapping.find(index)!=PageTable::EMPTY;
+	}
+
+	// true if page is cached or waits in staging area (safe under shared lock)
+	bool isCachedOrStaged(const size_t & index) const noexcept
+	{
+		return isCached(index) || (findStaged(index)>=0);
+	}
+
+	// speculative load: page is downloaded into staging area (overwriting oldest staged page) instead of a cache slot
+	// first access to it moves it into cache without another transfer, so pages that are never used do not evict anything
+	// without staging pages, page is loaded into cache
+	// returns false if page was already cached or staged
+	bool stage(const size_t & index)
+	{
+		if(isCachedOrStaged(index))
 		{
-			usageUsed[it->second]=1;
-			return usagePagePtr[it->second];
+			return false;
 		}
-		else
+
+		if(numStagingPages==0)
 		{
-			int ctrFound = -1;
-			while(ctrFound==-1)
-			{
-				if(usageUsed[ctr]>0)
-				{
-					usageUsed[ctr]=0;
-				}
+			access(index);
+			return true;
+		}
 
-				ctr++;
-				if(ctr>=size)
-				{
-					ctr=0;
-				}
+		const int staged = stagingCtr;
+		stagingCtr = (stagingCtr+1)%numStagingPages;
+		stagingIndex[staged]=NO_PAGE;
+
+		std::vector<cl_event> dependencies;
+		writeBackDependencies(index,dependencies);
+		Page<T> * const sel = stagingPages.get()+staged;
+		downloadPages(sel->ptr(), index, 1, dependencies);
+		sel->setTargetGpuPage(index);
+		sel->reset();
+		stagingIndex[staged]=index;
+		return true;
+	}
 
-				if(usageUsed[ctrEvict]==0)
-				{
-					ctrFound=ctrEvict;
-				}
+	// staged copy of page is stale after a write to vram that does not go through cache
+	void dropStaged(const size_t & index) noexcept
+	{
+		const int staged = findStaged(index);
+		if(staged>=0)
+		{
+			stagingIndex[staged]=NO_PAGE;
+		}
+	}
 
-				ctrEvict++;
-				if(ctrEvict>=size)
-				{
-					ctrEvict=0;
-				}
+	// page lookup, replacement decision is given to eviction strategy
+	Page<T> * const accessStrategy(const size_t & index)
+	{
+
+		const unsigned int slot = fastMapping.find(index);
+		if(slot!=PageTable::EMPTY)
+		{
+			// pinned slots are not in eviction order
+			if(!pinned[slot])
+			{
+				strategy->hit(slot);
 			}
+			return usagePagePtr[slot];
+		}
+		else
+		{
+			return missStrategy(index);
+		}
+	}
+
+
+	Page<T> * const accessStrategyDebug(const size_t & index)
+	{
 
-			if(usagePagePtr[ctrFound]->getTargetGpuPage()!=index)
+		const unsigned int slot = fastMapping.find(index);
+		if(slot!=PageTable::EMPTY)
+		{
+			// pinned slots are not in eviction order
+			if(!pinned[slot])
 			{
-				updatePage(usagePagePtr[ctrFound], index);
-				usagePagePtr[ctrFound]->reset();
+				strategy->hit(slot);
 			}
+			cacheHit.fetch_add(1,std::memory_order_relaxed);
+			return usagePagePtr[slot];
+		}
+		else
+		{
+			cacheMiss.fetch_add(1,std::memory_order_relaxed);
+			return missStrategy(index);
+		}
+	}
 
-			fastMapping.erase(usageIndex[ctrFound]);
-			fastMapping[index]=ctrFound;
-			usageIndex[ctrFound]=index;
 
-			return usagePagePtr[ctrFound];
+	void resetCacheHit() noexcept
+	{
+		cacheHit=0;
+	}
+
+	void resetCacheMiss() noexcept
+	{
+		cacheMiss=0;
+	}
 
+	size_t getTotalAccess() const noexcept
+	{
+		return cacheMiss.load() + cacheHit.load();
+	}
+
+	double getCacheHitRatio() const noexcept
+	{
+		const size_t hit = cacheHit.load();
+		return hit/(double)(hit+cacheMiss.load());
+	}
+
+	// loads page (if not cached) and excludes its slot from eviction until unpin
+	// at most 3/4 of slots (and never the last slot) can be pinned
+	// returns false if page was already pinned
+	bool pin(const size_t & index)
+	{
+		access(index);
+		const unsigned int slot = fastMapping.find(index);
+		if(pinned[slot])
+		{
+			return false;
+		}
+
+		if(numPinned>=maxPinned)
+		{
+			throw std::invalid_argument(std::string("error: pinned page limit (")+std::to_string(maxPinned)+std::string(") reached for cache of ")+std::to_string(size)+std::string(" pages"));
+		}
+		strategy->remove(slot);
+		pinned[slot]=1;
+		numPinned++;
+		return true;
+	}
+
+	// page can be evicted again
+	void unpin(const size_t & index) noexcept
+	{
+		const unsigned int slot = fastMapping.find(index);
+		if((slot!=PageTable::EMPTY) && pinned[slot])
+		{
+			pinned[slot]=0;
+			numPinned--;
+			strategy->insert(slot,index,false);
 		}
 	}
 
+	// uploads edited parts of all cached pages, pages stay cached as unedited
+	// needed before any vram access that does not go through this cache
+	void flushAll()
+	{
+		finishWriteBack();
+		bool uploaded = false;
+		for(size_t i=0;i<usagePagePtr.size();i++)
+		{
+			Page<T> * const sel = usagePagePtr[i];
+			if((usageIndex[i]!=NO_PAGE) && sel->isEdited())
+			{
+				uploadEdited(q->getQueue(),sel);
+				uploaded = true;
+			}
+		}
+
+		if(uploaded)
+		{
+			clFinish(q->getQueue());
+		}
+
+		for(size_t i=0;i<usagePagePtr.size();i++)
+		{
+			if(usageIndex[i]!=NO_PAGE)
+			{
+				usagePagePtr[i]->reset();
+			}
+		}
+	}
 
-	Page<T> * const accessClock2HandDebug(const size_t & index)
+	// uploads edited parts of cached pages in [firstPage,lastPage], they stay cached as unedited
+	// uploads are only enqueued, later commands of same queue (direct reads of vram) run after them
+	void flushRange(const size_t & firstPage, const size_t & lastPage)
 	{
+		finishWriteBack();
+		for(size_t i=0;i<usagePagePtr.size();i++)
+		{
+			Page<T> * const sel = usagePagePtr[i];
+			if((usageIndex[i]!=NO_PAGE) && (usageIndex[i]>=firstPage) && (usageIndex[i]<=lastPage) && sel->isEdited())
+			{
+				uploadEdited(q->getQueue(),sel);
+				sel->reset();
+			}
+		}
+	}
 
-		typename std::unordered_map<size_t,unsigned int>::iterator it = fastMapping.find(index);
-		if(it!=fastMapping.end())
+	// calls f(page index, page) for every cached page in [firstPage,lastPage]
+	template<typename F>
+	void forEachCachedPage(const size_t & firstPage, const size_t & lastPage, F f)
+	{
+		for(size_t i=0;i<usagePagePtr.size();i++)
 		{
-			usageUsed[it->second]=1;
-			cacheHit++;
-			return usagePagePtr[it->second];
+			if((usageIndex[i]!=NO_PAGE) && (usageIndex[i]>=firstPage) && (usageIndex[i]<=lastPage))
+			{
+				f(usageIndex[i],usagePagePtr[i]);
+			}
 		}
-		else
+	}
+
+	// staged copies of pages in [firstPage,lastPage] are stale after writes to vram that do not go through cache
+	void dropStagedRange(const size_t & firstPage, const size_t & lastPage) noexcept
+	{
+		for(int i=0;i<numStagingPages;i++)
 		{
-			int ctrFound = -1;
-			while(ctrFound==-1)
+			if((stagingIndex[i]!=NO_PAGE) && (stagingIndex[i]>=firstPage) && (stagingIndex[i]<=lastPage))
 			{
-				if(usageUsed[ctr]>0)
-				{
-					usageUsed[ctr]=0;
-				}
+				stagingIndex[i]=NO_PAGE;
+			}
+		}
+	}
 
-				ctr++;
-				if(ctr>=size)
+	// downloads cached pages in [firstPage,lastPage] again after vram was written without going through cache
+	// enqueued after all earlier commands of queue, returns when they are complete, cached (not uploaded) writes of these pages are lost
+	void reloadRange(const size_t & firstPage, const size_t & lastPage)
+	{
+		finishWriteBack();
+		dropStagedRange(firstPage,lastPage);
+		for(size_t i=0;i<usagePagePtr.size();i++)
+		{
+			if((usageIndex[i]!=NO_PAGE) && (usageIndex[i]>=firstPage) && (usageIndex[i]<=lastPage))
+			{
+				Page<T> * const sel = usagePagePtr[i];
+				cl_int err=clEnqueueReadBuffer(q->getQueue(),gpu->getMem(),CL_FALSE,sizeof(T)*usageIndex[i]*szp,sizeof(T)*szp,sel->ptr(),0,nullptr,nullptr);
+				if(CL_SUCCESS != err)
 				{
-					ctr=0;
+					throw std::invalid_argument("error: reload page ");
 				}
+			}
+		}
+		clFinish(q->getQueue());
 
-				if(usageUsed[ctrEvict]==0)
-				{
-					ctrFound=ctrEvict;
-				}
+		for(size_t i=0;i<usagePagePtr.size();i++)
+		{
+			if((usageIndex[i]!=NO_PAGE) && (usageIndex[i]>=firstPage) && (usageIndex[i]<=lastPage))
+			{
+				usagePagePtr[i]->reset();
+			}
+		}
+	}
 
-				ctrEvict++;
-				if(ctrEvict>=size)
+	// downloads all cached pages again after uncached writes, overwrites their cached (not uploaded) writes
+	// staged pages are dropped
+	void reloadAll()
+	{
+		finishWriteBack();
+		std::fill(stagingIndex.begin(),stagingIndex.end(),NO_PAGE);
+		for(size_t i=0;i<usagePagePtr.size();i++)
+		{
+			if(usageIndex[i]!=NO_PAGE)
+			{
+				Page<T> * const sel = usagePagePtr[i];
+				cl_int err=clEnqueueReadBuffer(q->getQueue(),gpu->getMem(),CL_FALSE,sizeof(T)*usageIndex[i]*szp,sizeof(T)*szp,sel->ptr(),0,nullptr,nullptr);
+				if(CL_SUCCESS != err)
 				{
-					ctrEvict=0;
+					throw std::invalid_argument("error: reload page ");
 				}
 			}
+		}
+		clFinish(q->getQueue());
 
-			if(usagePagePtr[ctrFound]->getTargetGpuPage()!=index)
+		for(size_t i=0;i<usagePagePtr.size();i++)
+		{
+			if(usageIndex[i]!=NO_PAGE)
 			{
-				updatePage(usagePagePtr[ctrFound], index);
-				usagePagePtr[ctrFound]->reset();
+				usagePagePtr[i]->reset();
 			}
+		}
+	}
 
-			fastMapping.erase(usageIndex[ctrFound]);
-			fastMapping[index]=ctrFound;
-			usageIndex[ctrFound]=index;
-			cacheMiss++;
-			return usagePagePtr[ctrFound];
+	// number of slots (active pages)
+	size_t getSize() const noexcept
+	{
+		return size;
+	}
 
+	// true if pinned pages still fit into the pin limit of a cache with numSlots slots
+	bool canResize(const size_t numSlots) const noexcept
+	{
+		return (numSlots>0) && (numPinned <= maxPinnedOf(numSlots));
+	}
+
+	// adds n empty slots that use given pages as buffers
+	// they are filled by next misses without evicting anything
+	void grow(std::shared_ptr<Page<T>> pages, const size_t n)
+	{
+		for(size_t i=0;i<n;i++)
+		{
+			usagePagePtr.push_back(pages.get()+i);
+			usageIndex.push_back(NO_PAGE);
+			pinned.push_back(0);
 		}
+		pageStorage.push_back(pages);
+		size += n;
+		rebuild();
 	}
 
+	// removes one slot while shrinking to numSlots: an empty slot if there is one, otherwise a victim of eviction strategy
+	// edited victim is uploaded before its buffer is released
+	// buffer of slot is moved to retired (lock-free readers may still be reading it, caller frees it after they are done)
+	// slot stays as a hole until compact()
+	// returns false when there are numSlots slots left
+	bool shrinkOne(const size_t numSlots, std::vector<Page<T>> & retired)
+	{
+		if(size<=numSlots)
+		{
+			return false;
+		}
 
-	void resetCacheHit() noexcept
+		unsigned int slot;
+		if(!freeSlots.empty())
+		{
+			slot = freeSlots.back();
+			freeSlots.pop_back();
+		}
+		else if(size - numPinned <= 1)
+		{
+			// pages pinned concurrently with resizing
+			return false;
+		}
+		else
+		{
+			// a cached page is never a ghost so it is a neutral "missed page" for the strategy
+			bool ghostHit;
+			slot = strategy->victim(usageIndex[firstCachedSlot()],ghostHit,nullptr);
+			Page<T> * const sel = usagePagePtr[slot];
+			if(sel->isEdited())
+			{
+				uploadVictim(sel);
+
+				// synchronous upload reads from page buffer that is going to be released
+				clFinish(q->getQueue());
+			}
+			fastMapping.erase(usageIndex[slot]);
+			usageIndex[slot]=NO_PAGE;
+		}
+
+		retired.push_back(std::move(*usagePagePtr[slot]));
+		*usagePagePtr[slot] = Page<T>();
+		usagePagePtr[slot] = nullptr;
+		size--;
+		return true;
+	}
+
+	// removes holes left by shrinkOne, rebuilds page lookup and eviction state for current number of slots
+	void compact()
 	{
-		cacheHit=0;
+		size_t ctr=0;
+		for(size_t i=0;i<usagePagePtr.size();i++)
+		{
+			if(usagePagePtr[i]!=nullptr)
+			{
+				usagePagePtr[ctr]=usagePagePtr[i];
+				usageIndex[ctr]=usageIndex[i];
+				pinned[ctr]=pinned[i];
+				ctr++;
+			}
+		}
+		usagePagePtr.resize(ctr);
+		usageIndex.resize(ctr);
+		pinned.resize(ctr);
+		rebuild();
 	}
 
-	void resetCacheMiss() noexcept
+	// true if there are background uploads that vram accesses outside of this cache must wait for
+	bool writeBackInFlight() const noexcept
 	{
-		cacheMiss=0;
+		return numWriteBackInFlight>0;
 	}
 
-	size_t getTotalAccess() const noexcept
+	// waits for all background uploads of evicted pages
+	// needed before any vram access that does not go through this cache (flush, find, uncached access)
+	void finishWriteBack()
+	{
+		if(numWriteBackInFlight==0)
+		{
+			return;
+		}
+
+		if(CL_SUCCESS != clFinish(qWriteBack->getQueue()))
+		{
+			throw std::invalid_argument("error: finish write-back queue");
+		}
+
+		for(int i=0;i<numWriteBackPages;i++)
+		{
+			releaseWriteBackEvent(i);
+		}
+	}
+
+	// uploads of edited pages call snapshotP->preserve() first, nullptr ends it
+	void setSnapshot(std::shared_ptr<VramSnapshot<T>> snapshotP) noexcept
 	{
-		return cacheMiss + cacheHit;
+		snapshot = snapshotP;
 	}
 
-	double getCacheHitRatio() const noexcept
+	~Cache()
 	{
-		return cacheHit/(double)(cacheHit+cacheMiss);
+		// staging pages must not be freed while their uploads are in flight
+		if(numWriteBackInFlight>0)
+		{
+			clFinish(qWriteBack->getQueue());
+			for(int i=0;i<numWriteBackPages;i++)
+			{
+				if(writeBackEvents[i]!=nullptr)
+				{
+					clReleaseEvent(writeBackEvents[i]);
+				}
+			}
+		}
 	}
 private:
 	size_t size;
-	unsigned int ctr;
-	unsigned int ctrEvict;
 	std::vector<Page<T>*> usagePagePtr;
 	std::vector<size_t> usageIndex;
-	std::vector<unsigned int> usageUsed;
-	std::unordered_map<size_t,unsigned int> fastMapping;
+	PageTable fastMapping;
+	std::unique_ptr<EvictionStrategy> strategy;
 
 	std::function<Page<T>*(const size_t&)> fImplementation;
 
 	std::shared_ptr<ClCommandQueue> q;
 	std::shared_ptr<ClArray<T>> gpu;
-	size_t cacheHit;
-	size_t cacheMiss;
+	std::atomic<size_t> cacheHit;
+	std::atomic<size_t> cacheMiss;
+	bool hitRatioDebugging;
 	int szp;
 
-	inline
-	void updatePage(Page<T> * const sel, const size_t & selectedPage) const
+	// asynchronous write-back of evicted edited pages
+	std::shared_ptr<ClCommandQueue> qWriteBack;
+	std::shared_ptr<Page<T>> writeBackPages;
+	std::vector<cl_event> writeBackEvents;
+	int numWriteBackPages;
+	int writeBackCtr;
+	int numWriteBackInFlight;
+
+	// coalesced loading of sequentially missed pages
+	size_t pageStride;
+	size_t numPages;
+	std::shared_ptr<Page<T>> readAheadPage;
+	int numReadAheadPages;
+	std::vector<unsigned int> readAheadSlots;
+
+	// what victim() reported for each read-ahead page, given to its insert()
+	std::vector<char> readAheadGhostHit;
+
+	// slot without page (after growing) or hole (while shrinking)
+	static constexpr size_t NO_PAGE = (size_t)-1;
+
+	// speculatively prefetched pages, not in cache until accessed
+	std::shared_ptr<Page<T>> stagingPages;
+	std::vector<size_t> stagingIndex;
+	int numStagingPages;
+	int stagingCtr;
+
+	// copy-on-write of a running snapshot, nullptr when there is none
+	std::shared_ptr<VramSnapshot<T>> snapshot;
+
+	// staging page that holds page index, -1 if not staged
+	int findStaged(const size_t & index) const noexcept
+	{
+		for(int i=0;i<numStagingPages;i++)
+		{
+			if(stagingIndex[i]==index)
+			{
+				return i;
+			}
+		}
+		return -1;
+	}
+
+	// empty slots that are used before evicting anything
+	std::vector<unsigned int> freeSlots;
+
+	// pinned buffers of slots (initial pages and pages added by grow)
+	std::vector<std::shared_ptr<Page<T>>> pageStorage;
+
+	EvictionPolicy evictionPolicy;
+
+	// at most 3/4 of slots and never the last slot can be pinned
+	static size_t maxPinnedOf(const size_t numSlots) noexcept
 	{
+		return numSlots - std::max((size_t)1,numSlots/4);
+	}
 
-#if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
-// windows
-// clGetEventInfo lags too much in windows for gt1030
-// no explicit idle-wait used
+	size_t firstCachedSlot() const noexcept
+	{
+		size_t i=0;
+		while(usageIndex[i]==NO_PAGE)
+		{
+			i++;
+		}
+		return i;
+	}
 
-		if (sel->isEdited())
+	// page lookup and eviction order for current slots
+	// recency/frequency history of eviction strategy starts over
+	void rebuild()
+	{
+		fastMapping = PageTable(numPages,usagePagePtr.size());
+		strategy = makeEvictionStrategy(evictionPolicy,usagePagePtr.size(),numPages);
+		freeSlots.clear();
+		for(size_t i=0;i<usagePagePtr.size();i++)
 		{
-			// upload edited
-			cl_int err = clEnqueueWriteBuffer(q->getQueue(), gpu->getMem(), CL_FALSE, sizeof(T) * (sel->getTargetGpuPage()) * szp, sizeof(T) * szp, sel->ptr(), 0, nullptr, nullptr);
-			if (CL_SUCCESS != err)
+			if(usageIndex[i]==NO_PAGE)
 			{
-				throw std::invalid_argument("error: write buffer");
+				freeSlots.push_back(i);
 			}
+			else
+			{
+				fastMapping.insert(usageIndex[i],i);
+				if(!pinned[i])
+				{
+					strategy->insert(i,usageIndex[i],false);
+				}
+			}
+		}
+		maxPinned=maxPinnedOf(usagePagePtr.size());
+	}
 
-			// download new
-			sel->setTargetGpuPage(selectedPage);
-			err = clEnqueueReadBuffer(q->getQueue(), gpu->getMem(), CL_TRUE, sizeof(T) * selectedPage * szp, sizeof(T) * szp, sel->ptr(), 0, nullptr, nullptr);
-			if (CL_SUCCESS != err)
+	// empty slot if there is one, otherwise victim of eviction strategy (ghostHit and evictable are same as EvictionStrategy::victim)
+	unsigned int claimSlot(const size_t & index, bool & ghostHit, const std::function<bool(const unsigned int)> & evictable)
+	{
+		if(!freeSlots.empty())
+		{
+			const unsigned int slot = freeSlots.back();
+			freeSlots.pop_back();
+			ghostHit = false;
+			return slot;
+		}
+		return strategy->victim(index,ghostHit,evictable);
+	}
+
+	// slots excluded from eviction (removed from eviction strategy while pinned)
+	std::vector<unsigned char> pinned;
+	size_t numPinned;
+	size_t maxPinned;
+
+	Page<T> * const missStrategy(const size_t & index)
+	{
+		if(numStagingPages>0)
+		{
+			const int staged = findStaged(index);
+			if(staged>=0)
 			{
-				throw std::invalid_argument("error: read buffer");
+				return missStaged(index,staged);
 			}
+		}
+
+		if((numReadAheadPages>0) && (index>=pageStride) && (fastMapping.find(index-pageStride)!=PageTable::EMPTY))
+		{
+			return missReadAhead(index);
+		}
 
+		bool ghostHit;
+		const unsigned int ctrFound = claimSlot(index,ghostHit,nullptr);
 
+		if((usageIndex[ctrFound]==NO_PAGE) || (usagePagePtr[ctrFound]->getTargetGpuPage()!=index))
+		{
+			updatePage(usagePagePtr[ctrFound], index);
+			usagePagePtr[ctrFound]->reset();
 		}
-		else
+
+		if(usageIndex[ctrFound]!=NO_PAGE)
 		{
-			// download new
-			sel->setTargetGpuPage(selectedPage);
-			cl_int err = clEnqueueReadBuffer(q->getQueue(), gpu->getMem(), CL_TRUE, sizeof(T) * selectedPage * szp, sizeof(T) * szp, sel->ptr(), 0, nullptr, nullptr);
-			if (CL_SUCCESS != err)
+			fastMapping.erase(usageIndex[ctrFound]);
+		}
+		fastMapping.insert(index,ctrFound);
+		usageIndex[ctrFound]=index;
+		strategy->insert(ctrFound,index,ghostHit);
+
+		return usagePagePtr[ctrFound];
+	}
+
+	// missed page was prefetched into staging area: buffers of staging page and victim slot are swapped instead of downloading
+	Page<T> * const missStaged(const size_t & index, const int staged)
+	{
+		bool ghostHit;
+		const unsigned int slot = claimSlot(index,ghostHit,nullptr);
+		Page<T> * const sel = usagePagePtr[slot];
+		if(usageIndex[slot]!=NO_PAGE)
+		{
+			// a synchronous upload may still read victim's buffer after it becomes a staging page
+			// next download into that staging page is on same in-order queue, after the upload
+			uploadVictim(sel);
+			fastMapping.erase(usageIndex[slot]);
+		}
+
+		std::swap(*sel,stagingPages.get()[staged]);
+		sel->reset();
+		stagingPages.get()[staged].reset();
+		stagingIndex[staged]=NO_PAGE;
+
+		fastMapping.insert(index,slot);
+		usageIndex[slot]=index;
+		strategy->insert(slot,index,ghostHit);
+		return sel;
+	}
+
+	// sequential miss: missed page and next uncached pages of this shard are placed into victim slots
+	// then all of them are downloaded with one transfer (rectangular when shards interleave pages)
+	// only clean victims are claimed for next pages, run ends where eviction strategy picks an edited victim (it is not evicted)
+	Page<T> * const missReadAhead(const size_t & index)
+	{
+		readAheadSlots.clear();
+		readAheadGhostHit.clear();
+		const std::function<bool(const unsigned int)> anySlot;
+		const std::function<bool(const unsigned int)> clean = [&](const unsigned int slot){ return !usagePagePtr[slot]->isEdited(); };
+		// pinned slots can not be claimed
+		const int maxReadAhead = std::min(numReadAheadPages,(int)(size - numPinned) - 1);
+		for(int k=0;k<=maxReadAhead;k++)
+		{
+			const size_t page = index + k*pageStride;
+			if((k>0) && ((page>=numPages) || (fastMapping.find(page)!=PageTable::EMPTY)))
+			{
+				break;
+			}
+
+			bool ghostHit;
+			const unsigned int slot = claimSlot(page,ghostHit,(k>0)?clean:anySlot);
+			if(slot==EvictionStrategy::NO_VICTIM)
+			{
+				break;
+			}
+
+			if(usageIndex[slot]!=NO_PAGE)
 			{
-				throw std::invalid_argument("error: read buffer");
+				uploadVictim(usagePagePtr[slot]);
+				fastMapping.erase(usageIndex[slot]);
 			}
+			readAheadSlots.push_back(slot);
+			readAheadGhostHit.push_back(ghostHit);
+		}
+
+		const int numLoaded = readAheadSlots.size();
+		std::vector<cl_event> dependencies;
+		for(int k=0;k<numLoaded;k++)
+		{
+			writeBackDependencies(index + k*pageStride,dependencies);
 		}
 
+		downloadPages(readAheadPage.get()->ptr(), index, numLoaded, dependencies);
+
+		for(int k=0;k<numLoaded;k++)
+		{
+			const size_t page = index + k*pageStride;
+			const unsigned int slot = readAheadSlots[k];
+			Page<T> * const sel = usagePagePtr[slot];
+			std::copy(readAheadPage.get()->ptr() + k*szp, readAheadPage.get()->ptr() + (k+1)*szp, sel->ptr());
+			sel->setTargetGpuPage(page);
+			sel->reset();
+
+			// cached copy is the valid one from now on
+			dropStaged(page);
+			fastMapping.insert(page,slot);
+			usageIndex[slot]=page;
+			strategy->insert(slot,page,readAheadGhostHit[k]);
+		}
+
+		return usagePagePtr[readAheadSlots[0]];
+	}
+
+	// downloads numPage pages (firstPage, firstPage+pageStride, ...) into consecutive pages of host memory
+	void downloadPages(T * const host, const size_t & firstPage, const int numPage, std::vector<cl_event> & dependencies)
+	{
+		const cl_uint numDependencies = dependencies.size();
+		const cl_event * const dependencyList = (numDependencies>0)?dependencies.data():nullptr;
+		const size_t pageBytes = sizeof(T) * szp;
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
+// windows
+		const cl_bool blocking = CL_TRUE;
+		cl_event * const evtPtr = nullptr;
 #else
 // linux
-// explicit idle-wait to overlap i/o with other threads by yield()
+		const cl_bool blocking = CL_FALSE;
 		cl_event evt;
-		if (sel->isEdited())
+		cl_event * const evtPtr = &evt;
+#endif
+
+		cl_int err = CL_SUCCESS;
+		if((pageStride==1) || (numPage==1))
+		{
+			err = clEnqueueReadBuffer(q->getQueue(), gpu->getMem(), blocking, pageBytes * firstPage, pageBytes * numPage, host, numDependencies, dependencyList, evtPtr);
+		}
+		else
+		{
+			const size_t bufferOrigin[3] = {pageBytes * firstPage, 0, 0};
+			const size_t hostOrigin[3] = {0, 0, 0};
+			const size_t region[3] = {pageBytes, (size_t)numPage, 1};
+			err = clEnqueueReadBufferRect(q->getQueue(), gpu->getMem(), blocking, bufferOrigin, hostOrigin, region,
+					pageBytes * pageStride, 0, pageBytes, 0, host, numDependencies, dependencyList, evtPtr);
+		}
+
+		if (CL_SUCCESS != err)
 		{
-			// upload edited
-			cl_int err = 	clEnqueueWriteBuffer(q->getQueue(), gpu->getMem(), CL_FALSE, sizeof(T) * (sel->getTargetGpuPage()) * szp, sizeof(T) * szp, sel->ptr(), 0, nullptr, nullptr);
+			throw std::invalid_argument("error: read buffer");
+		}
+
+#if !(defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__))
+		clFlush(q->getQueue());
+		ClEventWaiter::waitAndRelease(evt,"error: event info");
+#endif
+	}
+
+	// enqueues uploads of only the edited ranges of page to its frozen page
+	void uploadEdited(cl_command_queue queue, Page<T> * const sel) const
+	{
+		if(snapshot)
+		{
+			snapshot->preserve(sel->getTargetGpuPage(),sel->getTargetGpuPage());
+		}
+
+		const size_t frozenOffset = sel->getTargetGpuPage() * szp;
+		sel->forEachEditedRange([&](const size_t first, const size_t n){
+			cl_int err = clEnqueueWriteBuffer(queue, gpu->getMem(), CL_FALSE, sizeof(T) * (frozenOffset + first), sizeof(T) * n, sel->ptr() + first, 0, nullptr, nullptr);
 			if (CL_SUCCESS != err)
 			{
 				throw std::invalid_argument("error: write buffer");
 			}
+		});
+	}
 
-			// download new
-			sel->setTargetGpuPage(selectedPage);
-			err = 			clEnqueueReadBuffer(q->getQueue(), gpu->getMem(), CL_FALSE, sizeof(T) * selectedPage * szp, sizeof(T) * szp, sel->ptr(), 0, nullptr, &evt/*nullptr*/);
-			if (CL_SUCCESS != err)
+	void releaseWriteBackEvent(const int slot)
+	{
+		if(writeBackEvents[slot]!=nullptr)
+		{
+			if(CL_SUCCESS != clReleaseEvent(writeBackEvents[slot]))
 			{
-				throw std::invalid_argument("error: read buffer");
+				std::cout<<"error: release event"<<std::endl;
 			}
+			writeBackEvents[slot]=nullptr;
+			numWriteBackInFlight--;
+		}
+	}
 
-
+	// copies an edited page into a staging page and enqueues its upload on the write-back queue
+	// so that the download of the replacement page does not wait behind it
+	void writeBackAsync(Page<T> * const sel)
+	{
+		// uploads complete in order, so the next staging page in round-robin order is the oldest one
+		const int slot = writeBackCtr;
+		writeBackCtr++;
+		if(writeBackCtr>=numWriteBackPages)
+		{
+			writeBackCtr=0;
 		}
-		else
+
+		if(writeBackEvents[slot]!=nullptr)
 		{
-			// download new
-			sel->setTargetGpuPage(selectedPage);
-			cl_int err = 	clEnqueueReadBuffer(q->getQueue(), gpu->getMem(), CL_FALSE, sizeof(T) * selectedPage * szp, sizeof(T) * szp, sel->ptr(), 0, nullptr, &evt/*nullptr*/);
-			if (CL_SUCCESS != err)
+			if(CL_SUCCESS != clWaitForEvents(1,writeBackEvents.data()+slot))
 			{
-				throw std::invalid_argument("error: read buffer");
+				throw std::invalid_argument("error: wait write-back");
 			}
+			releaseWriteBackEvent(slot);
 		}
 
-		clFlush(q->getQueue());
+		Page<T> * const stage = writeBackPages.get()+slot;
+		stage->copyEdited(*sel);
+		stage->setTargetGpuPage(sel->getTargetGpuPage());
+
+		uploadEdited(qWriteBack->getQueue(),stage);
 
-		const cl_event_info evtInf = CL_EVENT_COMMAND_EXECUTION_STATUS;
-		cl_int evtStatus0 = 0;
-		if(CL_SUCCESS != clGetEventInfo(evt, evtInf,sizeof(cl_int), &evtStatus0, nullptr))
+		// in-order queue: marker completes after all partial uploads of the page
+		cl_int err = clEnqueueMarkerWithWaitList(qWriteBack->getQueue(), 0, nullptr, writeBackEvents.data()+slot);
+		if (CL_SUCCESS != err)
 		{
-			throw std::invalid_argument("error: event info");
+			throw std::invalid_argument("error: write-back marker");
 		}
+		numWriteBackInFlight++;
+		clFlush(qWriteBack->getQueue());
+	}
 
-		while (evtStatus0 != CL_COMPLETE)
+	// a page that is still being uploaded from a staging page must not be downloaded before the upload ends
+	void writeBackDependencies(const size_t & selectedPage, std::vector<cl_event> & dependencies) const
+	{
+		if(numWriteBackInFlight==0)
 		{
-			if(CL_SUCCESS != clGetEventInfo(evt, evtInf,sizeof(cl_int), &evtStatus0, nullptr))
+			return;
+		}
+
+		for(int i=0;i<numWriteBackPages;i++)
+		{
+			if((writeBackEvents[i]!=nullptr) && (writeBackPages.get()[i].getTargetGpuPage()==selectedPage))
 			{
-				throw std::invalid_argument("error: event info");
+				dependencies.push_back(writeBackEvents[i]);
 			}
-			std::this_thread::yield();
 		}
-		if(CL_SUCCESS != clReleaseEvent(evt))
+	}
+
+	// edited page that is going to be replaced is uploaded first (in background when staging pages exist)
+	void uploadVictim(Page<T> * const sel)
+	{
+		if (sel->isEdited())
 		{
-			std::cout<<"error: release event"<<std::endl;
+			if(numWriteBackPages>0)
+			{
+				// upload edited, in background
+				writeBackAsync(sel);
+			}
+			else
+			{
+				// upload edited
+				uploadEdited(q->getQueue(),sel);
+			}
 		}
+	}
+
+	inline
+	void updatePage(Page<T> * const sel, const size_t & selectedPage)
+	{
+		uploadVictim(sel);
+
+		std::vector<cl_event> dependencies;
+		writeBackDependencies(selectedPage,dependencies);
+		const cl_uint numDependencies = dependencies.size();
+		const cl_event * const dependencyList = (numDependencies>0)?dependencies.data():nullptr;
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
+// windows
+// clGetEventInfo lags too much in windows for gt1030
+// no explicit idle-wait used
+
+		// download new
+		sel->setTargetGpuPage(selectedPage);
+		cl_int err = clEnqueueReadBuffer(q->getQueue(), gpu->getMem(), CL_TRUE, sizeof(T) * selectedPage * szp, sizeof(T) * szp, sel->ptr(), numDependencies, dependencyList, nullptr);
+		if (CL_SUCCESS != err)
+		{
+			throw std::invalid_argument("error: read buffer");
+		}
+
+#else
+// linux
+// explicit idle-wait to overlap i/o with other threads
+		cl_event evt;
+
+		// download new
+		sel->setTargetGpuPage(selectedPage);
+		cl_int err = 	clEnqueueReadBuffer(q->getQueue(), gpu->getMem(), CL_FALSE, sizeof(T) * selectedPage * szp, sizeof(T) * szp, sel->ptr(), numDependencies, dependencyList, &evt);
+		if (CL_SUCCESS != err)
+		{
+			throw std::invalid_argument("error: read buffer");
+		}
+
+		clFlush(q->getQueue());
+
+		// spin shortly, then sleep until opencl callback wakes this thread
+		ClEventWaiter::waitAndRelease(evt,"error: event info");
 
 #endif
 
@@ -0,0 +1,163 @@
+/*
+ * PageTable.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: tugrul
+ */
+
+#ifndef PAGETABLE_H_
+#define PAGETABLE_H_
+
+#include<vector>
+#include<limits>
+#include<cstddef>
+
+// maps frozen page index (in a graphics card) to active page slot (in cache)
+// frozen page indices of a virtual array are dense integers in [0,numPages) so a flat array gives 1 load per cache hit
+// for huge number of pages per virtual gpu, a compact open-addressing (linear probing) table is used instead to keep RAM usage close to cache size
+class PageTable
+{
+public:
+	static constexpr unsigned int EMPTY = std::numeric_limits<unsigned int>::max();
+
+	// flat table is used when it needs at most this many entries (4MB per virtual gpu)
+	static constexpr size_t MAX_DIRECT_PAGES = 1024*1024;
+
+	PageTable():direct(true),mask(0),shift(0){}
+
+	// numPages: number of frozen pages of virtual gpu
+	// numSlots: number of active pages (cache size), hashed table is sized to keep load factor below 0.5
+	PageTable(const size_t numPages, const size_t numSlots)
+	{
+		direct = (numPages <= MAX_DIRECT_PAGES);
+		if(direct)
+		{
+			slot.resize(numPages,EMPTY);
+			mask=0;
+			shift=0;
+		}
+		else
+		{
+			size_t capacity = 16;
+			while(capacity < numSlots*2)
+			{
+				capacity *= 2;
+			}
+			slot.resize(capacity,EMPTY);
+			key.resize(capacity,0);
+			mask = capacity-1;
+			shift = 64;
+			while(capacity>1)
+			{
+				shift--;
+				capacity>>=1;
+			}
+		}
+	}
+
+	// returns active page slot of frozen page or EMPTY
+	inline
+	unsigned int find(const size_t & page) const noexcept
+	{
+		if(direct)
+		{
+			return slot[page];
+		}
+
+		size_t i = hash(page);
+		while(slot[i]!=EMPTY)
+		{
+			if(key[i]==page)
+			{
+				return slot[i];
+			}
+			i = (i+1) & mask;
+		}
+		return EMPTY;
+	}
+
+	// page must not be in table already
+	void insert(const size_t & page, const unsigned int activeSlot) noexcept
+	{
+		if(direct)
+		{
+			slot[page]=activeSlot;
+			return;
+		}
+
+		size_t i = hash(page);
+		while(slot[i]!=EMPTY)
+		{
+			i = (i+1) & mask;
+		}
+		key[i]=page;
+		slot[i]=activeSlot;
+	}
+
+	void erase(const size_t & page) noexcept
+	{
+		if(direct)
+		{
+			if(page<slot.size())
+			{
+				slot[page]=EMPTY;
+			}
+			return;
+		}
+
+		size_t i = hash(page);
+		while(slot[i]!=EMPTY)
+		{
+			if(key[i]==page)
+			{
+				break;
+			}
+			i = (i+1) & mask;
+		}
+
+		if(slot[i]==EMPTY)
+		{
+			return;
+		}
+
+		// backward-shift deletion keeps probe chains intact without tombstones
+		slot[i]=EMPTY;
+		size_t j = i;
+		while(true)
+		{
+			j = (j+1) & mask;
+			if(slot[j]==EMPTY)
+			{
+				break;
+			}
+
+			const size_t home = hash(key[j]);
+
+			// entry at j can move to the hole at i only if its home is not cyclically in (i,j]
+			const bool stay = (i<=j) ? ((i<home) && (home<=j)) : ((i<home) || (home<=j));
+			if(!stay)
+			{
+				key[i]=key[j];
+				slot[i]=slot[j];
+				slot[j]=EMPTY;
+				i=j;
+			}
+		}
+	}
+
+private:
+	bool direct;
+	size_t mask;
+	int shift;
+	std::vector<unsigned int> slot;
+	std::vector<size_t> key;
+
+	inline
+	size_t hash(const size_t & page) const noexcept
+	{
+		// fibonacci hashing spreads consecutive page indices over the table
+		return ((page * 11400714819323198485ull) >> shift) & mask;
+	}
+};
+
+#endif /* PAGETABLE_H_ */
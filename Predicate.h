@@ -0,0 +1,198 @@
+/*
+ * Predicate.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: tugrul
+ */
+
+#ifndef PREDICATE_H_
+#define PREDICATE_H_
+
+#include<memory>
+#include<string>
+#include<vector>
+#include<cstdint>
+#include<cstring>
+#include<algorithm>
+#include<type_traits>
+
+// OpenCL C name of a member type that predicates can compare
+template<typename S>
+struct PredicateType;
+
+template<> struct PredicateType<int32_t> { static constexpr const char * name = "int"; };
+template<> struct PredicateType<int64_t> { static constexpr const char * name = "long"; };
+template<> struct PredicateType<float> { static constexpr const char * name = "float"; };
+template<> struct PredicateType<double> { static constexpr const char * name = "double"; };
+
+// condition on members of an element, evaluated in vram by VirtualMultiArray::findIf()
+// made of member comparisons (PredicateField) combined with &&, ||, !
+//		Particle p;
+//		PredicateField mass(p,p.mass);
+//		PredicateField id(p,p.id);
+//		auto result = particles.findIf((mass.inRange(1.0f,2.0f) && (id != 0)) || (mass > 100.0f));
+// compared values are not part of the generated kernel, predicates with same structure but different values share one compiled kernel
+class Predicate
+{
+public:
+	// appends condition (OpenCL C) for element bytes e (__global const uchar *) to code and its compared values to operand
+	// operand v (__global const uchar *) holds values with 8-byte alignment
+	void build(std::string & code, std::vector<unsigned char> & operand) const
+	{
+		node->build(code,operand);
+	}
+
+	// true if a double is compared (kernel needs cl_khr_fp64)
+	bool usesDouble() const noexcept
+	{
+		return node->fp64;
+	}
+
+	// end (offset + size in bytes) of the last byte of element that is read
+	size_t memberEnd() const noexcept
+	{
+		return node->end;
+	}
+
+	friend Predicate operator && (const Predicate & p1, const Predicate & p2)
+	{
+		return Predicate(std::make_shared<Node>(Node::And,p1.node,p2.node));
+	}
+
+	friend Predicate operator || (const Predicate & p1, const Predicate & p2)
+	{
+		return Predicate(std::make_shared<Node>(Node::Or,p1.node,p2.node));
+	}
+
+	friend Predicate operator ! (const Predicate & p)
+	{
+		return Predicate(std::make_shared<Node>(Node::Not,p.node,nullptr));
+	}
+
+	// comparison of member at byte offset of element (type name) with value bytes
+	static Predicate compare(const size_t offset, const char * typeName, const size_t typeBytes, const char * op,
+			const void * value, const bool fp64)
+	{
+		auto n = std::make_shared<Node>(Node::Compare,nullptr,nullptr);
+		n->offset = offset;
+		n->typeName = typeName;
+		n->op = op;
+		n->value.resize(typeBytes);
+		std::memcpy(n->value.data(),value,typeBytes);
+		n->fp64 = fp64;
+		n->end = offset + typeBytes;
+		return Predicate(n);
+	}
+private:
+	struct Node
+	{
+		enum Kind { Compare, And, Or, Not };
+
+		Node(const Kind k, std::shared_ptr<const Node> l, std::shared_ptr<const Node> r):kind(k),left(l),right(r),offset(0),typeName(nullptr),op(nullptr),fp64(false),end(0)
+		{
+			if(left)
+			{
+				fp64 = left->fp64;
+				end = left->end;
+			}
+			if(right)
+			{
+				fp64 = fp64 || right->fp64;
+				end = std::max(end,right->end);
+			}
+		}
+
+		void build(std::string & code, std::vector<unsigned char> & operand) const
+		{
+			if(kind==Compare)
+			{
+				const size_t position = ((operand.size()+7)/8)*8;
+				operand.resize(position);
+				operand.insert(operand.end(),value.begin(),value.end());
+				const std::string type = std::string("(__global const ")+typeName+std::string(" *)");
+				code += std::string("(*")+type+std::string("(e+")+std::to_string(offset)+std::string(") ")+op+
+						std::string(" *")+type+std::string("(v+")+std::to_string(position)+std::string("))");
+			}
+			else if(kind==Not)
+			{
+				code += "(!";
+				left->build(code,operand);
+				code += ")";
+			}
+			else
+			{
+				code += "(";
+				left->build(code,operand);
+				code += (kind==And)?" && ":" || ";
+				right->build(code,operand);
+				code += ")";
+			}
+		}
+
+		Kind kind;
+		std::shared_ptr<const Node> left;
+		std::shared_ptr<const Node> right;
+
+		// comparison
+		size_t offset;
+		const char * typeName;
+		const char * op;
+		std::vector<unsigned char> value;
+
+		bool fp64;
+		size_t end;
+	};
+
+	Predicate(std::shared_ptr<const Node> n):node(n){}
+
+	std::shared_ptr<const Node> node;
+};
+
+// a member of element type, comparing it with a value makes a Predicate
+// S: int32_t, int64_t, float or double
+template<typename S>
+class PredicateField
+{
+public:
+	// obj: any object of element type, member: member of obj to be compared (same way as VirtualMultiArray::find)
+	template<typename T>
+	PredicateField(const T & obj, const S & member):offset((size_t)&member - (size_t)&obj)
+	{
+		static_assert(sizeof(PredicateType<S>)>0,"member type of a predicate needs to be int32_t, int64_t, float or double");
+	}
+
+	// byte offset of member in element
+	size_t memberOffset() const noexcept
+	{
+		return offset;
+	}
+
+	// lo <= member < hi
+	Predicate inRange(const S & lo, const S & hi) const
+	{
+		return ((*this) >= lo) && ((*this) < hi);
+	}
+
+	friend Predicate operator < (const PredicateField & f, const S & val) { return f.compare("<",val); }
+	friend Predicate operator <= (const PredicateField & f, const S & val) { return f.compare("<=",val); }
+	friend Predicate operator > (const PredicateField & f, const S & val) { return f.compare(">",val); }
+	friend Predicate operator >= (const PredicateField & f, const S & val) { return f.compare(">=",val); }
+	friend Predicate operator == (const PredicateField & f, const S & val) { return f.compare("==",val); }
+	friend Predicate operator != (const PredicateField & f, const S & val) { return f.compare("!=",val); }
+
+	friend Predicate operator < (const S & val, const PredicateField & f) { return f.compare(">",val); }
+	friend Predicate operator <= (const S & val, const PredicateField & f) { return f.compare(">=",val); }
+	friend Predicate operator > (const S & val, const PredicateField & f) { return f.compare("<",val); }
+	friend Predicate operator >= (const S & val, const PredicateField & f) { return f.compare("<=",val); }
+	friend Predicate operator == (const S & val, const PredicateField & f) { return f.compare("==",val); }
+	friend Predicate operator != (const S & val, const PredicateField & f) { return f.compare("!=",val); }
+private:
+	size_t offset;
+
+	Predicate compare(const char * op, const S & val) const
+	{
+		return Predicate::compare(offset,PredicateType<S>::name,sizeof(S),op,&val,std::is_same<S,double>::value);
+	}
+};
+
+#endif /* PREDICATE_H_ */
@@ -0,0 +1,277 @@
+/*
+ * ThreadPool.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: tugrul
+ */
+
+#ifndef THREADPOOL_H_
+#define THREADPOOL_H_
+
+#include<mutex>
+#include<thread>
+#include<condition_variable>
+#include<memory>
+#include<atomic>
+#include<vector>
+#include<functional>
+#include<exception>
+#include<algorithm>
+
+// threads per logical core of the shared pool (more than 1 to keep pcie busy while some threads wait for page transfers)
+constexpr size_t PARALLEL_POOL_THREADS_PER_CORE = 2;
+
+// persistent threads for parallel loops
+// every participant (workers + calling thread) owns a contiguous part of loop iterations and takes them from its front,
+// a participant that runs out steals back half of the largest remaining part of others
+// a loop started from inside a loop body (or from a worker) runs serially on calling thread
+// loops of different calling threads are run one after another
+class ThreadPool
+{
+public:
+	// numWorker: number of threads besides the calling thread of a loop
+	ThreadPool(const size_t numWorker):generation(0),job(nullptr),stop(false)
+	{
+		for(size_t i=0;i<numWorker;i++)
+		{
+			thr.push_back(std::thread([this,i](){ run(i); }));
+		}
+	}
+
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool & operator = (const ThreadPool &) = delete;
+
+	// pool of the process, created on first use
+	static ThreadPool & shared()
+	{
+		static ThreadPool pool(std::max((size_t)std::thread::hardware_concurrency(),(size_t)1) * PARALLEL_POOL_THREADS_PER_CORE - 1);
+		return pool;
+	}
+
+	// number of threads that run a loop (workers + calling thread)
+	size_t size() const noexcept
+	{
+		return thr.size()+1;
+	}
+
+	// runs task(i) for every i in [0,numTask) and returns when all are complete
+	// after first exception of a task, remaining tasks are skipped and the exception is rethrown
+	void parallelFor(const size_t numTask, const std::function<void(size_t)> & task)
+	{
+		if(numTask==0)
+		{
+			return;
+		}
+
+		if(insideLoop() || (numTask==1) || thr.empty())
+		{
+			for(size_t i=0;i<numTask;i++)
+			{
+				task(i);
+			}
+			return;
+		}
+
+		std::unique_lock<std::mutex> loopLock(loopMut);
+		const size_t numPart = size();
+		Job j(task,numPart);
+		for(size_t i=0;i<numPart;i++)
+		{
+			j.part[i].begin = (numTask*i)/numPart;
+			j.part[i].end = (numTask*(i+1))/numPart;
+		}
+
+		{
+			std::unique_lock<std::mutex> lck(m);
+			job = &j;
+			generation++;
+		}
+		cond.notify_all();
+
+		insideLoop() = true;
+		participate(j,numPart-1);
+		insideLoop() = false;
+
+		// no worker joins after job is withdrawn, the ones that joined may still be running a task
+		{
+			std::unique_lock<std::mutex> lck(m);
+			job = nullptr;
+			doneCond.wait(lck,[&](){ return j.busy==0; });
+		}
+
+		if(j.error)
+		{
+			std::rethrow_exception(j.error);
+		}
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::unique_lock<std::mutex> lck(m);
+			stop = true;
+		}
+		cond.notify_all();
+		for(auto & t:thr)
+		{
+			if(t.joinable())
+			{
+				t.join();
+			}
+		}
+	}
+private:
+	// iterations [begin,end) of a participant
+	struct alignas(64) Part
+	{
+		std::mutex m;
+		size_t begin;
+		size_t end;
+	};
+
+	struct Job
+	{
+		Job(const std::function<void(size_t)> & t, const size_t numPart):task(t),part(new Part[numPart]),numPart(numPart),failed(false),busy(0){}
+
+		const std::function<void(size_t)> & task;
+		std::unique_ptr<Part[]> part;
+		const size_t numPart;
+		std::atomic<bool> failed;
+		std::mutex errorMut;
+		std::exception_ptr error;
+
+		// number of workers in job, guarded by m of pool
+		size_t busy;
+	};
+
+	std::vector<std::thread> thr;
+	std::mutex loopMut;
+	std::mutex m;
+	std::condition_variable cond;
+	std::condition_variable doneCond;
+
+	// guarded by m
+	size_t generation;
+	Job * job;
+	bool stop;
+
+	static bool & insideLoop()
+	{
+		static thread_local bool inside = false;
+		return inside;
+	}
+
+	// takes next iteration of own part, or steals back half of largest part, false when nothing is left
+	static bool take(Job & j, const size_t self, size_t & iteration)
+	{
+		Part & own = j.part[self];
+		while(true)
+		{
+			{
+				std::unique_lock<std::mutex> lck(own.m);
+				if(own.begin<own.end)
+				{
+					iteration = own.begin++;
+					return true;
+				}
+			}
+
+			size_t victim = j.numPart;
+			size_t largest = 0;
+			for(size_t i=0;i<j.numPart;i++)
+			{
+				if(i!=self)
+				{
+					std::unique_lock<std::mutex> lck(j.part[i].m);
+					const size_t remaining = j.part[i].end - j.part[i].begin;
+					if(remaining>largest)
+					{
+						largest = remaining;
+						victim = i;
+					}
+				}
+			}
+
+			if(victim==j.numPart)
+			{
+				return false;
+			}
+
+			size_t stolenBegin = 0;
+			size_t stolenEnd = 0;
+			{
+				std::unique_lock<std::mutex> lck(j.part[victim].m);
+				const size_t remaining = j.part[victim].end - j.part[victim].begin;
+				if(remaining==0)
+				{
+					// emptied by its owner or another thief in the meantime
+					continue;
+				}
+				stolenEnd = j.part[victim].end;
+				stolenBegin = stolenEnd - (remaining+1)/2;
+				j.part[victim].end = stolenBegin;
+			}
+
+			std::unique_lock<std::mutex> lck(own.m);
+			own.begin = stolenBegin;
+			own.end = stolenEnd;
+		}
+	}
+
+	static void participate(Job & j, const size_t self)
+	{
+		size_t iteration = 0;
+		while(take(j,self,iteration))
+		{
+			if(j.failed.load(std::memory_order_relaxed))
+			{
+				continue;
+			}
+
+			try
+			{
+				j.task(iteration);
+			}
+			catch(...)
+			{
+				std::unique_lock<std::mutex> lck(j.errorMut);
+				if(!j.error)
+				{
+					j.error = std::current_exception();
+				}
+				j.failed.store(true,std::memory_order_relaxed);
+			}
+		}
+	}
+
+	void run(const size_t self)
+	{
+		insideLoop() = true;
+		size_t seen = 0;
+		while(true)
+		{
+			Job * j = nullptr;
+			{
+				std::unique_lock<std::mutex> lck(m);
+				cond.wait(lck,[&](){ return stop || ((job!=nullptr) && (generation!=seen)); });
+				if(stop)
+				{
+					return;
+				}
+				seen = generation;
+				j = job;
+				j->busy++;
+			}
+
+			participate(*j,self);
+
+			std::unique_lock<std::mutex> lck(m);
+			if(--j->busy==0)
+			{
+				doneCond.notify_all();
+			}
+		}
+	}
+};
+
+#endif /* THREADPOOL_H_ */
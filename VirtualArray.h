@@ -11,6 +11,11 @@
 #include<memory>
 #include<vector>
 #include<mutex>
+#include<shared_mutex>
+#include<atomic>
+#include<algorithm>
+#include<map>
+#include<string>
 #include <stdexcept>
 #include"ClPlatform.h"
 #include"ClDevice.h"
@@ -20,17 +25,74 @@
 #include"ClCompute.h"
 #include"Page.h"
 #include"PageCache.h"
+#include"ClEvent.h"
 #include<CL/cl.h>
 
 constexpr int ASSUMED_L1_DATA_CACHE_LINE_SIZE = 64;
-constexpr int computedMutexPaddingSize=ASSUMED_L1_DATA_CACHE_LINE_SIZE-sizeof(std::mutex);
+
+// work-group size of findIf kernels
+constexpr size_t FIND_IF_GROUP_SIZE = 256;
+
+// work-group size and maximum number of work-groups of reduce kernels (partial results per virtual gpu)
+constexpr size_t REDUCE_GROUP_SIZE = 256;
+constexpr size_t REDUCE_MAX_GROUPS = 256;
+
+// number of compiled findIf/reduce kernels (distinct predicate structures) kept per virtual gpu
+constexpr size_t COMPUTE_KERNEL_CACHE_SIZE = 16;
+
+// results of work-groups of a reduce kernel, count[i]==0 means work-group i has no element (its sum, min, max are not valid)
+template<typename A>
+struct ReducePartials
+{
+	std::vector<A> sum;
+	std::vector<A> min;
+	std::vector<A> max;
+	std::vector<cl_ulong> count;
+};
+constexpr int computedMutexPaddingSize=ASSUMED_L1_DATA_CACHE_LINE_SIZE-sizeof(std::shared_mutex)-sizeof(std::atomic<size_t>);
 constexpr int finalMutexPaddingSize=((computedMutexPaddingSize<0)?1:computedMutexPaddingSize);
+
+// shared ownership: readers that hit cache (and uncached readers)
+// exclusive ownership: writers and page misses
+// version: odd while an exclusive owner may be changing pages, +2 after every exclusive ownership
+//          lets lock-free readers (thread-local page cache of VirtualMultiArray) detect evictions and writes
 struct LMutex
 {
-	std::mutex m;
+	std::shared_mutex m;
+	std::atomic<size_t> version{0};
 	char padding[finalMutexPaddingSize];
 };
 
+// exclusive ownership of a LMutex that also updates its version
+class LExclusiveLock
+{
+public:
+	LExclusiveLock(LMutex & lm):lck(lm.m),mtx(&lm)
+	{
+		versionLocked = mtx->version.load(std::memory_order_relaxed);
+		mtx->version.store(versionLocked+1,std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+
+	// version that readers will see after this lock is released
+	size_t versionAfterUnlock() const noexcept
+	{
+		return versionLocked+2;
+	}
+
+	LExclusiveLock(const LExclusiveLock&) = delete;
+	LExclusiveLock& operator=(const LExclusiveLock&) = delete;
+
+	~LExclusiveLock()
+	{
+		mtx->version.store(versionLocked+2,std::memory_order_release);
+	}
+private:
+	std::unique_lock<std::shared_mutex> lck;
+	LMutex * mtx;
+	size_t versionLocked;
+};
+
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
 // windows
 
@@ -48,7 +110,7 @@ class VirtualArray
 {
 public:
 	// don't use this
-	VirtualArray():sz(0),szp(0),nump(0),computeFind(nullptr),pageCache(nullptr){}
+	VirtualArray():sz(0),szp(0),nump(0),numShard(1),usePinned(true),computeFind(nullptr){}
 
 	// for generating a physical-card based virtual array
 	// takes a single virtual graphics card, size(in number of objects), page size(in number of objects), active pages (number of pages in interleaved order for caching)
@@ -58,9 +120,16 @@ public:
 	// numActivePageP: parameter for number of active pages (in RAM) for interleaved access caching (instead of LRU, etc) with less book-keeping overhead
 	// usePinnedArraysOnly: true=pins (LRU) cache array so OS can't page it out
 	// useLRUdebugging: uses a debugging version of LRU cache to be able to query cache hit/miss info
+	// numWriteBackPageP: number of staging pages for uploading evicted edited pages in background (0 = synchronous upload)
+	// policy: page replacement algorithm of LRU cache
+	// numShardP: number of independent caches (each with its own lock in VirtualMultiArray) sharing active pages, queue and buffer
+	// numReadAheadPageP: number of next pages loaded together with a sequentially missed page (in same transfer)
+	// numStagingPageP: number of pages for speculative prefetches that do not evict cached pages (split between shards)
 	VirtualArray(	const size_t sizeP,  ClDevice device, const int sizePageP=1024, const int numActivePageP=50,
-					const bool usePinnedArraysOnly=true, const bool useLRUdebugging=false
-					):sz(sizeP),szp(sizePageP),nump(numActivePageP){
+					const bool usePinnedArraysOnly=true, const bool useLRUdebugging=false, const int numWriteBackPageP=0,
+					const EvictionPolicy policy=EvictionPolicy::Clock2Hand, const int numShardP=1,
+					const int numReadAheadPageP=0, const int numStagingPageP=0
+					):sz(sizeP),szp(sizePageP),nump(numActivePageP),numShard(numShardP){
 		computeFind = nullptr;
 		dv = std::make_unique<ClDevice>();
 		*dv=device.generate()[0];
@@ -74,7 +143,9 @@ public:
 			cpu.get()[i]=Page<T>(szp,*ctx,*q,usePinnedArraysOnly);
 		}
 
-		pageCache = std::make_unique<Cache<T>>(numActivePageP,q, gpu, szp,usePinnedArraysOnly,cpu,useLRUdebugging);
+		usePinned=usePinnedArraysOnly;
+		allocateWriteBackPages(numWriteBackPageP,usePinnedArraysOnly);
+		createCacheShards(usePinnedArraysOnly,useLRUdebugging,numWriteBackPageP,policy,numReadAheadPageP,numStagingPageP);
 
 	}
 
@@ -86,8 +157,15 @@ public:
 	// sizePageP: number of elements of each page (bigger pages = more RAM used)
 	// numActivePageP: parameter for number of active pages (in RAM) for interleaved access caching (instead of LRU, etc) with less book-keeping overhead
 	// useLRUdebugging: uses a debugging version of LRU cache to be able to query cache hit/miss info
+	// numWriteBackPageP: number of staging pages for uploading evicted edited pages in background (0 = synchronous upload)
+	// policy: page replacement algorithm of LRU cache
+	// numShardP: number of independent caches (each with its own lock in VirtualMultiArray) sharing active pages, queue and buffer
+	// numReadAheadPageP: number of next pages loaded together with a sequentially missed page (in same transfer)
+	// numStagingPageP: number of pages for speculative prefetches that do not evict cached pages (split between shards)
 	VirtualArray(const size_t sizeP, ClContext context, ClDevice device, const int sizePageP=1024, const int numActivePageP=50,
-			const bool usePinnedArraysOnly=true, const bool useLRUdebugging=false):sz(sizeP),szp(sizePageP),nump(numActivePageP){
+			const bool usePinnedArraysOnly=true, const bool useLRUdebugging=false, const int numWriteBackPageP=0,
+			const EvictionPolicy policy=EvictionPolicy::Clock2Hand, const int numShardP=1,
+			const int numReadAheadPageP=0, const int numStagingPageP=0):sz(sizeP),szp(sizePageP),nump(numActivePageP),numShard(numShardP){
 		computeFind = nullptr;
 		dv = std::make_unique<ClDevice>();
 		*dv=device.generate()[0];
@@ -99,7 +177,9 @@ public:
 		{
 			cpu.get()[i]=Page<T>(szp,*ctx,*q,usePinnedArraysOnly);
 		}
-		pageCache = std::make_unique<Cache<T>>(numActivePageP,q, gpu, szp,usePinnedArraysOnly,cpu,useLRUdebugging);
+		usePinned=usePinnedArraysOnly;
+		allocateWriteBackPages(numWriteBackPageP,usePinnedArraysOnly);
+		createCacheShards(usePinnedArraysOnly,useLRUdebugging,numWriteBackPageP,policy,numReadAheadPageP,numStagingPageP);
 
 	}
 
@@ -109,31 +189,126 @@ public:
 	T get(const size_t & index)
 	{
 		const size_t selectedPage = index/szp;
-		Page<T> * sel = pageCache->access(selectedPage);
+		Page<T> * sel = cacheOf(selectedPage)->access(selectedPage);
 		return sel->get(index - selectedPage * szp);
 	}
 
+	// page that holds element at index (loaded into cache if needed)
+	// for callers that keep the page pointer while cache state does not change
+	Page<T> * getPage(const size_t & index)
+	{
+		const size_t selectedPage = index/szp;
+		return cacheOf(selectedPage)->access(selectedPage);
+	}
+
+	// keeps page of element at index in cache until unpin, returns false if it was already pinned
+	bool pin(const size_t & index)
+	{
+		const size_t selectedPage = index/szp;
+		return cacheOf(selectedPage)->pin(selectedPage);
+	}
+
+	void unpin(const size_t & index)
+	{
+		const size_t selectedPage = index/szp;
+		cacheOf(selectedPage)->unpin(selectedPage);
+	}
+
+	// page that holds element at index, only if it is already cached and cache can record the hit under a shared lock
+	// returns nullptr otherwise, then getPage() or get() is used with exclusive lock
+	Page<T> * getPageShared(const size_t & index)
+	{
+		const size_t selectedPage = index/szp;
+		return cacheOf(selectedPage)->accessShared(selectedPage);
+	}
+
+	// true if page of element at index is cached, does not count as an access
+	bool isCached(const size_t & index)
+	{
+		const size_t selectedPage = index/szp;
+		return cacheOf(selectedPage)->isCached(selectedPage);
+	}
+
+	// true if page of element at index is cached or prefetched into staging area, does not count as an access
+	bool isCachedOrStaged(const size_t & index)
+	{
+		const size_t selectedPage = index/szp;
+		return cacheOf(selectedPage)->isCachedOrStaged(selectedPage);
+	}
+
+	// speculatively loads page of element at index into staging area of its cache shard (into cache when shard has no staging pages)
+	// returns false if it was already cached or staged
+	bool stage(const size_t & index)
+	{
+		const size_t selectedPage = index/szp;
+		return cacheOf(selectedPage)->stage(selectedPage);
+	}
+
+	// average of all cache shards
 	double getCacheHitRatio() const noexcept
 	{
-		return pageCache->getCacheHitRatio();
+		double result = 0.0;
+		for(const auto & shard:pageCache)
+		{
+			result += shard->getCacheHitRatio();
+		}
+		return result/numShard;
 	}
 
 	void resetCacheHitRatio() const noexcept
 	{
-		pageCache->resetCacheHit();
-		pageCache->resetCacheMiss();
+		for(const auto & shard:pageCache)
+		{
+			shard->resetCacheHit();
+			shard->resetCacheMiss();
+		}
+	}
+
+	// index of cache shard (and its lock) that serves the element at index
+	int getShardOfElement(const size_t & index) const noexcept
+	{
+		return (index/szp)%numShard;
+	}
+
+	int getNumShard() const noexcept
+	{
+		return numShard;
+	}
+
+	// true if vram access to element at index has to wait for background uploads of evicted pages first
+	// only the cache shard of the element uploads its page
+	bool writeBackInFlight(const size_t & index) const noexcept
+	{
+		return cacheOf(index/szp)->writeBackInFlight();
+	}
+
+	// waits for background uploads of evicted pages of the cache shard that serves element at index
+	void finishWriteBack(const size_t & index) const
+	{
+		cacheOf(index/szp)->finishWriteBack();
+	}
+
+	// waits for background uploads of all cache shards
+	void finishWriteBack() const
+	{
+		for(const auto & shard:pageCache)
+		{
+			shard->finishWriteBack();
+		}
 	}
 
 	// uncached array access for reading an element at an index
+	// reads into a local variable instead of an active page so that concurrent readers can use it under a shared lock
+	// caller has to call finishWriteBack(index) first if writeBackInFlight(index)
 	T getUncached(const size_t & index) const
 	{
 		const size_t selectedPage = index/szp;
-		const size_t selectedActivePage = selectedPage % nump;
 
-		Page<T> * const __restrict__ page = cpu.get() + selectedActivePage;
+		T result;
+		T * const __restrict__ resultPtr = &result;
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
 		// windows
-		cl_int err = clEnqueueReadBuffer(q->getQueue(), gpu->getMem(), CL_TRUE, sizeof(T) * (selectedPage * szp + (index % szp)), sizeof(T), page->ptr(), 0, nullptr, nullptr);
+		cl_int err = clEnqueueReadBuffer(q->getQueue(), gpu->getMem(), CL_TRUE, sizeof(T) * (selectedPage * szp + (index % szp)), sizeof(T), resultPtr, 0, nullptr, nullptr);
 		if (CL_SUCCESS != err)
 		{
 			throw std::invalid_argument("error: stream read buffer");
@@ -141,48 +316,34 @@ public:
 #else
 		// linux
 		cl_event evt;
-		cl_int err = clEnqueueReadBuffer(q->getQueue(), gpu->getMem(), CL_FALSE, sizeof(T) * (selectedPage * szp + (index % szp)), sizeof(T), page->ptr(), 0, nullptr, &evt);
+		cl_int err = clEnqueueReadBuffer(q->getQueue(), gpu->getMem(), CL_FALSE, sizeof(T) * (selectedPage * szp + (index % szp)), sizeof(T), resultPtr, 0, nullptr, &evt);
 		if (CL_SUCCESS != err)
 		{
 			throw std::invalid_argument("error: stream read buffer");
 		}
 		clFlush(q->getQueue());
 
-		const cl_event_info evtInf = CL_EVENT_COMMAND_EXECUTION_STATUS;
-		cl_int evtStatus0 = 0;
-		if (CL_SUCCESS != clGetEventInfo(evt, evtInf, sizeof(cl_int), &evtStatus0, nullptr))
-		{
-			throw std::invalid_argument("error: event info stream read");
-		}
-
-		while (evtStatus0 != CL_COMPLETE)
-		{
-			if (CL_SUCCESS != clGetEventInfo(evt, evtInf, sizeof(cl_int), &evtStatus0, nullptr))
-			{
-				throw std::invalid_argument("error: event info stream read");
-			}
-			std::this_thread::yield();
-		}
-		if (CL_SUCCESS != clReleaseEvent(evt))
-		{
-			std::cout << "error: release event" << std::endl;
-		}
+		ClEventWaiter::waitAndRelease(evt,"error: event info stream read");
 
 #endif
-		return page->ptr()[0];
+		return result;
 	}
 
-	// uncached array access for reading an element at an index
+	// uncached array access for writing an element at an index
+	// writes from a local copy instead of an active page so that other cache shards can run concurrently
 	void setUncached(const size_t & index, const T val) const
 	{
+		// a background upload of an evicted page may still be in flight
+		finishWriteBack(index);
+
 		const size_t selectedPage = index/szp;
-		const size_t selectedActivePage = selectedPage % nump;
+		cacheOf(selectedPage)->dropStaged(selectedPage);
+		preserveForSnapshot(selectedPage,selectedPage);
 
-		Page<T> * const __restrict__ page = cpu.get() + selectedActivePage;
-		page->ptr()[0]=val;
+		const T * const __restrict__ valPtr = &val;
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
 		// windows
-		cl_int err = clEnqueueWriteBuffer(q->getQueue(), gpu->getMem(), CL_TRUE, sizeof(T) * (selectedPage * szp + (index % szp)), sizeof(T), page->ptr(), 0, nullptr, nullptr);
+		cl_int err = clEnqueueWriteBuffer(q->getQueue(), gpu->getMem(), CL_TRUE, sizeof(T) * (selectedPage * szp + (index % szp)), sizeof(T), valPtr, 0, nullptr, nullptr);
 		if (CL_SUCCESS != err)
 		{
 			throw std::invalid_argument("error: stream write buffer");
@@ -190,32 +351,14 @@ public:
 #else
 		// linux
 		cl_event evt;
-		cl_int err = clEnqueueWriteBuffer(q->getQueue(), gpu->getMem(), CL_FALSE, sizeof(T) * (selectedPage * szp + (index % szp)), sizeof(T), page->ptr(), 0, nullptr, &evt);
+		cl_int err = clEnqueueWriteBuffer(q->getQueue(), gpu->getMem(), CL_FALSE, sizeof(T) * (selectedPage * szp + (index % szp)), sizeof(T), valPtr, 0, nullptr, &evt);
 		if (CL_SUCCESS != err)
 		{
 			throw std::invalid_argument("error: stream write buffer");
 		}
 		clFlush(q->getQueue());
 
-		const cl_event_info evtInf = CL_EVENT_COMMAND_EXECUTION_STATUS;
-		cl_int evtStatus0 = 0;
-		if (CL_SUCCESS != clGetEventInfo(evt, evtInf, sizeof(cl_int), &evtStatus0, nullptr))
-		{
-			throw std::invalid_argument("error: event info stream write");
-		}
-
-		while (evtStatus0 != CL_COMPLETE)
-		{
-			if (CL_SUCCESS != clGetEventInfo(evt, evtInf, sizeof(cl_int), &evtStatus0, nullptr))
-			{
-				throw std::invalid_argument("error: event info stream write");
-			}
-			std::this_thread::yield();
-		}
-		if (CL_SUCCESS != clReleaseEvent(evt))
-		{
-			std::cout << "error: release event" << std::endl;
-		}
+		ClEventWaiter::waitAndRelease(evt,"error: event info stream write");
 
 #endif
 		
@@ -226,9 +369,10 @@ public:
 	void set(const size_t & index, const T & val)
 	{
 		const size_t selectedPage = index/szp;
-		Page<T> * sel = pageCache->access(selectedPage);
-		sel->edit(index - selectedPage * szp, val);
-		sel->markAsEdited();
+		Page<T> * sel = cacheOf(selectedPage)->access(selectedPage);
+		const int selectedElement = index - selectedPage * szp;
+		sel->edit(selectedElement, val);
+		sel->markAsEdited(selectedElement);
 	}
 
 
@@ -239,19 +383,19 @@ public:
 	{
 		std::vector<T> result;
 		const size_t selectedPage = index/szp;
-		Page<T> * sel = pageCache->access(selectedPage);
+		Page<T> * sel = cacheOf(selectedPage)->access(selectedPage);
 		return sel->getN(index - selectedPage * szp, n);
 	}
 
-
 	// array access for writing to an element at an index
 	// val: value to write to array
 	void setN(const size_t & index, const std::vector<T> & val, const size_t & valIndex, const size_t n)
 	{
 		const size_t selectedPage = index/szp;
-		Page<T> * sel = pageCache->access(selectedPage);
-		sel->editN(index - selectedPage * szp, val, valIndex, n);
-		sel->markAsEdited();
+		Page<T> * sel = cacheOf(selectedPage)->access(selectedPage);
+		const int selectedElement = index - selectedPage * szp;
+		sel->editN(selectedElement, val, valIndex, n);
+		sel->markAsEdited(selectedElement, n);
 	}
 
 
@@ -265,51 +409,342 @@ public:
 	void copyToBuffer(const size_t & index, const size_t & range, T * const out)
 	{
 		const size_t selectedPage = index/szp;
-		Page<T> * sel = pageCache->access(selectedPage);
+		Page<T> * sel = cacheOf(selectedPage)->access(selectedPage);
 		sel->readN(out, index - selectedPage * szp, range);
 	}
 
-	// array access for reading many elements directly through raw pointer
+	// same as copyToBuffer but under a shared lock
+	// returns false without reading when page is not cached or cache needs exclusive access for the hit
+	bool copyToBufferShared(const size_t & index, const size_t & range, T * const out)
+	{
+		const size_t selectedPage = index/szp;
+		Page<T> * sel = cacheOf(selectedPage)->accessShared(selectedPage);
+		if(sel==nullptr)
+		{
+			return false;
+		}
+		sel->readN(out, index - selectedPage * szp, range);
+		return true;
+	}
+
+	// array access for writing many elements directly through raw pointer
 	// without allocating any buffer
 	// index: starting element
-	// range: number of elements to read into out parameter
-	// out: target array to be filled with data
-	void copyFromBuffer(const size_t & index, const size_t & range, T * const in)
+	// range: number of elements to write from in parameter
+	// in: source array
+	void copyFromBuffer(const size_t & index, const size_t & range, const T * const in)
 	{
 		const size_t selectedPage = index/szp;
-		Page<T> * sel = pageCache->access(selectedPage);
-		sel->writeN(in, index - selectedPage * szp, range);
-		sel->markAsEdited();
+		Page<T> * sel = cacheOf(selectedPage)->access(selectedPage);
+		const int selectedElement = index - selectedPage * szp;
+		sel->writeN(in, selectedElement, range);
+		sel->markAsEdited(selectedElement, range);
+	}
+
+	// before direct reads of vram: edited cached pages with page index in [firstPage,lastPage] are uploaded (enqueued) on all shards
+	// caller holds locks of all cache shards
+	void flushPages(const size_t & firstPage, const size_t & lastPage)
+	{
+		for(const auto & shard:pageCache)
+		{
+			shard->flushRange(firstPage,lastPage);
+		}
+	}
+
+	// before direct writes to vram: background uploads are completed, staged copies are dropped
+	// and f(page index, page) is called for every cached page in [firstPage,lastPage] to update its data
+	// caller holds locks of all cache shards
+	template<typename F>
+	void prepareDirectWrite(const size_t & firstPage, const size_t & lastPage, F f)
+	{
+		for(const auto & shard:pageCache)
+		{
+			shard->finishWriteBack();
+			shard->dropStagedRange(firstPage,lastPage);
+			shard->forEachCachedPage(firstPage,lastPage,f);
+		}
+	}
+
+	// transfer between vram and host memory that does not go through cache
+	// numRow blocks of rowElements elements: vram block k starts at element vramElement + k*pageSize, host block k at host + k*hostPitch
+	// linux: enqueued without blocking, returned event completes with the transfer (caller waits and releases it)
+	// windows: blocking, returns nullptr
+	cl_event enqueueDirect(const bool write, const size_t vramElement, const size_t rowElements, const size_t numRow, T * const host, const size_t hostPitch)
+	{
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
+		// windows
+		const cl_bool blocking = CL_TRUE;
+		cl_event * const evtPtr = nullptr;
+		cl_event evt = nullptr;
+#else
+		// linux
+		const cl_bool blocking = CL_FALSE;
+		cl_event evt = nullptr;
+		cl_event * const evtPtr = &evt;
+#endif
+
+		if(write && (numRow>0) && (rowElements>0))
+		{
+			preserveForSnapshot(vramElement/szp,(vramElement + (numRow-1)*szp + rowElements - 1)/szp);
+		}
+
+		cl_int err = CL_SUCCESS;
+		if(numRow==1)
+		{
+			err = write?
+				clEnqueueWriteBuffer(q->getQueue(), gpu->getMem(), blocking, sizeof(T) * vramElement, sizeof(T) * rowElements, host, 0, nullptr, evtPtr):
+				clEnqueueReadBuffer(q->getQueue(), gpu->getMem(), blocking, sizeof(T) * vramElement, sizeof(T) * rowElements, host, 0, nullptr, evtPtr);
+		}
+		else
+		{
+			const size_t bufferOrigin[3] = {sizeof(T) * vramElement, 0, 0};
+			const size_t hostOrigin[3] = {0, 0, 0};
+			const size_t region[3] = {sizeof(T) * rowElements, numRow, 1};
+			err = write?
+				clEnqueueWriteBufferRect(q->getQueue(), gpu->getMem(), blocking, bufferOrigin, hostOrigin, region,
+					sizeof(T) * szp, 0, sizeof(T) * hostPitch, 0, host, 0, nullptr, evtPtr):
+				clEnqueueReadBufferRect(q->getQueue(), gpu->getMem(), blocking, bufferOrigin, hostOrigin, region,
+					sizeof(T) * szp, 0, sizeof(T) * hostPitch, 0, host, 0, nullptr, evtPtr);
+		}
+
+		if(CL_SUCCESS != err)
+		{
+			throw std::invalid_argument(write?"error: direct write buffer":"error: direct read buffer");
+		}
+
+		clFlush(q->getQueue());
+		return evt;
+	}
+
+	// after direct writes to vram: cached pages in [firstPage,lastPage] are downloaded again
+	// returns when all earlier commands of queue are complete
+	// caller holds locks of all cache shards
+	void reloadPages(const size_t & firstPage, const size_t & lastPage)
+	{
+		for(const auto & shard:pageCache)
+		{
+			shard->reloadRange(firstPage,lastPage);
+		}
+	}
+
+	// waits for all commands of queue (like uploads enqueued by flushPages)
+	void finish()
+	{
+		if(CL_SUCCESS != clFinish(q->getQueue()))
+		{
+			throw std::invalid_argument("error: finish queue");
+		}
+	}
+
+	// sets n elements of vram starting at vramElement to val without sending them through pcie
+	// pattern fill when element size is a power of 2 (up to 128 bytes) or all bytes of val are equal (like zero)
+	// otherwise first element is written and then copied onto ranges of doubling size after it
+	// linux: enqueued without blocking, returned event completes with the fill (caller waits and releases it)
+	// windows: blocking, returns nullptr
+	cl_event enqueueFill(const size_t vramElement, const size_t n, const T & val)
+	{
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
+		// windows
+		cl_event * const evtPtr = nullptr;
+		cl_event evt = nullptr;
+#else
+		// linux
+		cl_event evt = nullptr;
+		cl_event * const evtPtr = &evt;
+#endif
+
+		if(n>0)
+		{
+			preserveForSnapshot(vramElement/szp,(vramElement+n-1)/szp);
+		}
+
+		const unsigned char * const bytes = reinterpret_cast<const unsigned char *>(&val);
+		const bool sameBytes = std::all_of(bytes,bytes+sizeof(T),[&](const unsigned char b){ return b==bytes[0]; });
+		const bool powerOf2 = (sizeof(T)<=128) && ((sizeof(T)&(sizeof(T)-1))==0);
+		cl_int err = CL_SUCCESS;
+		if(sameBytes || powerOf2)
+		{
+			err = clEnqueueFillBuffer(q->getQueue(), gpu->getMem(), bytes, sameBytes?1:sizeof(T), sizeof(T) * vramElement, sizeof(T) * n, 0, nullptr, evtPtr);
+		}
+		else
+		{
+			// copied ranges never overlap their sources, in-order queue runs them after the part they copy from is filled
+			err = clEnqueueWriteBuffer(q->getQueue(), gpu->getMem(), CL_TRUE, sizeof(T) * vramElement, sizeof(T), &val, 0, nullptr, nullptr);
+			size_t filled = 1;
+			while((CL_SUCCESS == err) && (filled<n))
+			{
+				const size_t m = std::min(filled,n-filled);
+				err = clEnqueueCopyBuffer(q->getQueue(), gpu->getMem(), gpu->getMem(), sizeof(T) * vramElement, sizeof(T) * (vramElement + filled), sizeof(T) * m,
+						0, nullptr, (filled+m<n)?nullptr:evtPtr);
+				filled += m;
+			}
+		}
+
+		if(CL_SUCCESS != err)
+		{
+			throw std::invalid_argument("error: fill buffer");
+		}
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
+		finish();
+#else
+		clFlush(q->getQueue());
+#endif
+		return evt;
+	}
+
+	// true if vram of other is in same OpenCL context (same physical card), so that it can be used by enqueueCopyFrom
+	bool sharesContextWith(const VirtualArray<T> & other) const noexcept
+	{
+		return *ctx->ctxPtr() == *other.ctx->ctxPtr();
+	}
+
+	// enqueues a vram-to-vram copy of n elements from src (starting at srcElement) to this (starting at dstElement) on queue of this
+	// src needs to share context, ranges must not overlap when src is this
+	void enqueueCopyFrom(const VirtualArray<T> & src, const size_t srcElement, const size_t dstElement, const size_t n)
+	{
+		if(n>0)
+		{
+			preserveForSnapshot(dstElement/szp,(dstElement+n-1)/szp);
+		}
+
+		cl_int err = clEnqueueCopyBuffer(q->getQueue(), src.gpu->getMem(), gpu->getMem(), sizeof(T) * srcElement, sizeof(T) * dstElement, sizeof(T) * n, 0, nullptr, nullptr);
+		if(CL_SUCCESS != err)
+		{
+			throw std::invalid_argument("error: copy buffer");
+		}
+	}
+
+	// starts copy-on-write of vram for VirtualMultiArray::snapshot(): from now on, a frozen page that is written
+	// (by cache uploads or direct writes) before saveSnapshot() takes it is copied to RAM first
+	// caller holds locks of all cache shards, edited cached pages need to be uploaded before
+	void beginSnapshot()
+	{
+		if(snapshot)
+		{
+			throw std::invalid_argument("error: snapshot is already running");
+		}
+		snapshot = std::make_shared<VramSnapshot<T>>(q,gpu,szp);
+		for(const auto & shard:pageCache)
+		{
+			shard->setSnapshot(snapshot);
+		}
+	}
+
+	// true between beginSnapshot() and endSnapshot()
+	bool snapshotRunning() const noexcept
+	{
+		return snapshot!=nullptr;
+	}
+
+	// frozen pages [firstPage,lastPage] were read from vram into host (page k at host + (k-firstPage)*hostPitch)
+	// copy-on-write copies of them replace what was read, later writes to them are not copied
+	// caller holds locks of all cache shards
+	void saveSnapshot(const size_t & firstPage, const size_t & lastPage, T * const host, const size_t hostPitch)
+	{
+		snapshot->save(firstPage,lastPage,host,hostPitch);
+	}
+
+	// caller holds locks of all cache shards
+	void endSnapshot()
+	{
+		snapshot = nullptr;
+		for(const auto & shard:pageCache)
+		{
+			shard->setSnapshot(nullptr);
+		}
 	}
 
 	// operation for updating pages after uncached streaming
 	// overwrites all cached (but not evicted yet) write operations
-	void reloadPage(size_t pageIdx)
+	// caller holds locks of all cache shards
+	void reloadAllPages()
 	{
-		Page<T> * sel = cpu.get()+pageIdx;
-		cl_int err=clEnqueueReadBuffer(q->getQueue(),gpu->getMem(),CL_FALSE,sizeof(T)*(sel->getTargetGpuPage())* szp,sizeof(T)* szp,sel->ptr(),0,nullptr,nullptr);
-		if(CL_SUCCESS != err)
+		for(const auto & shard:pageCache)
 		{
-			throw std::invalid_argument("error: flush page ");
+			shard->reloadAll();
 		}
-		clFinish(q->getQueue());
-		sel->reset();
 	}
 
 	// a sub-operation of VirtualMultiArray::find() to do fully gpu-accelerated element search
-	void flushPage(size_t pageIdx)
+	// caller holds locks of all cache shards
+	void flushAllPages()
+	{
+		for(const auto & shard:pageCache)
+		{
+			shard->flushAll();
+		}
+	}
+
+	// number of active pages a shard has when virtual gpu has numActivePageP active pages
+	int shardSizeOf(const int numActivePageP, const int shard) const noexcept
+	{
+		return numActivePageP/numShard + ((shard<numActivePageP%numShard)?1:0);
+	}
+
+	// number of frozen pages served by a shard
+	size_t numPageOfShard(const int shard) const noexcept
+	{
+		const size_t numPage = sz/szp;
+		return (numPage>(size_t)shard)?((numPage - shard + numShard - 1)/numShard):0;
+	}
+
+	// throws if a shard can not have its part of numActivePageP active pages
+	void checkCacheSize(const int numActivePageP) const
 	{
-		Page<T> * sel = cpu.get()+pageIdx;
-		if(sel->isEdited())
+		for(int i=0;i<numShard;i++)
 		{
-			cl_int err=clEnqueueWriteBuffer(q->getQueue(),gpu->getMem(),CL_FALSE,sizeof(T)*(sel->getTargetGpuPage())* szp,sizeof(T)* szp,sel->ptr(),0,nullptr,nullptr);
-			if(CL_SUCCESS != err)
+			const int numActiveShard = shardSizeOf(numActivePageP,i);
+			if((numActiveShard<1) || ((size_t)numActiveShard>numPageOfShard(i)))
+			{
+				throw std::invalid_argument(std::string("error: cache shard ")+std::to_string(i)+std::string(" can not have ")+std::to_string(numActiveShard)+std::string(" active pages (it serves ")+std::to_string(numPageOfShard(i))+std::string(" pages)"));
+			}
+
+			if(pageCache.size()>0 && !pageCache[i]->canResize(numActiveShard))
 			{
-				throw std::invalid_argument("error: flush page ");
+				throw std::invalid_argument(std::string("error: pinned pages of cache shard ")+std::to_string(i)+std::string(" do not fit into ")+std::to_string(numActiveShard)+std::string(" active pages"));
 			}
-			clFinish(q->getQueue());
 		}
-		sel->reset();
+	}
+
+	// online resizing of a cache shard, called by VirtualMultiArray::resizeCache
+	// growing allocates new pinned pages (without any lock) and then adds them (with exclusive lock of shard)
+	std::shared_ptr<Page<T>> allocatePages(const int n) const
+	{
+		std::shared_ptr<Page<T>> pages(new Page<T>[n],[](Page<T> * ptr){delete [] ptr;});
+		for(int i=0;i<n;i++)
+		{
+			pages.get()[i]=Page<T>(szp,*ctx,*q,usePinned);
+		}
+		return pages;
+	}
+
+	int getShardSize(const int shard) const noexcept
+	{
+		return pageCache[shard]->getSize();
+	}
+
+	void growShard(const int shard, std::shared_ptr<Page<T>> pages, const int n)
+	{
+		pageCache[shard]->grow(pages,n);
+		nump += n;
+	}
+
+	// one slot per call so that readers wait for at most one page upload
+	// buffer of removed slot is moved to retired
+	bool shrinkShardOne(const int shard, const int numActiveShard, std::vector<Page<T>> & retired)
+	{
+		if(pageCache[shard]->shrinkOne(numActiveShard,retired))
+		{
+			nump--;
+			return true;
+		}
+		return false;
+	}
+
+	void compactShard(const int shard)
+	{
+		pageCache[shard]->compact();
 	}
 
 	// opencl compute test
@@ -438,6 +873,233 @@ public:
 
 	}
 
+	// indices (in vram of this virtual gpu, ascending) of elements in [0,n) that satisfy condition, all with work-groups of FIND_IF_GROUP_SIZE
+	// condition: OpenCL C expression of element bytes e and operand bytes v (see Predicate::build)
+	// first pass counts matches per work-group, host turns counts into offsets and allocates result,
+	// second pass writes indices of every work-group at its offset in order (prefix sum of matches in local memory)
+	// compiled kernels are kept per condition code (see cachedCompute)
+	std::vector<size_t> findIf(const std::string & condition, const std::vector<unsigned char> & operand, const bool fp64, const size_t n)
+	{
+		if(n==0)
+		{
+			return std::vector<size_t>();
+		}
+
+		const std::string code = std::string(fp64?"#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n":"")+
+				std::string("#define __OBJ_SIZE__ ")+std::to_string(sizeof(T))+std::string("UL\n")+
+				std::string("#define __GROUP_SIZE__ ")+std::to_string(FIND_IF_GROUP_SIZE)+std::string("\n")+
+				std::string("#define __CONDITION__ ")+condition+std::string("\n")+
+				std::string(R"(
+					__kernel void findIf(	__global const unsigned char * arr,
+											__global const unsigned char * v,
+											__global const ulong * numElement,
+											__global const int * pass,
+											__global uint * groupCount,
+											__global ulong * found)
+					{
+						__local uint scan[__GROUP_SIZE__];
+						const size_t id = get_global_id(0);
+						const size_t lid = get_local_id(0);
+						const size_t grp = get_group_id(0);
+
+						uint match = 0;
+						if(id < *numElement)
+						{
+							__global const unsigned char * e = arr + id*__OBJ_SIZE__;
+							match = (__CONDITION__)?1:0;
+						}
+
+						/* inclusive prefix sum of matches of work-group */
+						scan[lid] = match;
+						barrier(CLK_LOCAL_MEM_FENCE);
+						for(uint s=1; s<__GROUP_SIZE__; s<<=1)
+						{
+							const uint x = (lid>=s)?scan[lid-s]:0;
+							barrier(CLK_LOCAL_MEM_FENCE);
+							scan[lid] += x;
+							barrier(CLK_LOCAL_MEM_FENCE);
+						}
+
+						if(*pass == 0)
+						{
+							if(lid == __GROUP_SIZE__-1)
+							{
+								groupCount[grp] = scan[lid];
+							}
+						}
+						else if(match)
+						{
+							/* groupCount holds offsets of work-groups in second pass */
+							found[groupCount[grp] + scan[lid] - 1] = id;
+						}
+					}
+				)");
+
+		ClCompute & compute = cachedCompute(code,"findIf",[&](ClCompute & c)
+		{
+			c.addParameter(*ctx,"data buffer",64,0,gpu->getMem());
+			c.addParameter(*ctx,"operand",8,1);
+			c.addParameter(*ctx,"number of elements",sizeof(cl_ulong),2);
+			c.addParameter(*ctx,"pass",sizeof(cl_int),3);
+			c.addParameter(*ctx,"group count",sizeof(cl_uint),4);
+			c.addParameter(*ctx,"found index list",sizeof(cl_ulong),5);
+		});
+
+		const size_t numGroup = (n + FIND_IF_GROUP_SIZE - 1)/FIND_IF_GROUP_SIZE;
+		const std::vector<unsigned char> operandData = paddedOperand(operand);
+		fitParameter(compute,"operand",operandData.size(),1);
+		fitParameter(compute,"group count",numGroup*sizeof(cl_uint),4);
+
+		// count pass
+		const cl_ulong numElement = n;
+		const cl_int passCount = 0;
+		const cl_int passFill = 1;
+		std::vector<cl_uint> groupCount(numGroup);
+		compute.setArgValueAsync("operand",*q,operandData.data());
+		compute.setArgValueAsync("number of elements",*q,&numElement);
+		compute.setArgValueAsync("pass",*q,&passCount);
+		compute.runAsync(*q,numGroup*FIND_IF_GROUP_SIZE,FIND_IF_GROUP_SIZE);
+		compute.getArgValueAsync("group count",*q,*groupCount.data());
+		compute.sync(*q);
+
+		// offsets of work-groups
+		size_t numFound = 0;
+		for(size_t i=0;i<numGroup;i++)
+		{
+			const size_t c = groupCount[i];
+			groupCount[i] = numFound;
+			numFound += c;
+		}
+
+		if(numFound==0)
+		{
+			return std::vector<size_t>();
+		}
+
+		// fill pass
+		std::vector<cl_ulong> found(numFound);
+		fitParameter(compute,"found index list",numFound*sizeof(cl_ulong),5);
+		compute.setArgValueAsync("group count",*q,groupCount.data());
+		compute.setArgValueAsync("pass",*q,&passFill);
+		compute.runAsync(*q,numGroup*FIND_IF_GROUP_SIZE,FIND_IF_GROUP_SIZE);
+		compute.getArgValueAsync("found index list",*q,*found.data());
+		compute.sync(*q);
+		return std::vector<size_t>(found.begin(),found.end());
+	}
+
+	// sum, minimum, maximum and count of member (at byte offset of element, OpenCL C type memberType) of elements in [0,n) that satisfy condition
+	// A: accumulator type (accumulatorType is its OpenCL C name), member values are converted to it
+	// condition: same as findIf, "1" for all elements
+	// every work-item reduces a strided part of elements, then work-groups reduce in local memory (tree reduction)
+	// one result per work-group is read (at most REDUCE_MAX_GROUPS)
+	template<typename A>
+	ReducePartials<A> reduce(const size_t memberOffset, const char * memberType, const char * accumulatorType,
+			const std::string & condition, const std::vector<unsigned char> & operand, const bool fp64, const size_t n)
+	{
+		const std::string code = std::string(fp64?"#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n":"")+
+				std::string("#define __OBJ_SIZE__ ")+std::to_string(sizeof(T))+std::string("UL\n")+
+				std::string("#define __GROUP_SIZE__ ")+std::to_string(REDUCE_GROUP_SIZE)+std::string("\n")+
+				std::string("#define __CONDITION__ ")+condition+std::string("\n")+
+				std::string("#define __ACC__ ")+accumulatorType+std::string("\n")+
+				std::string("#define __MEMBER__ (*(__global const ")+memberType+std::string(" *)(e+")+std::to_string(memberOffset)+std::string("))\n")+
+				std::string(R"(
+					__kernel void reduce(	__global const unsigned char * arr,
+											__global const unsigned char * v,
+											__global const ulong * numElement,
+											__global __ACC__ * partialSum,
+											__global __ACC__ * partialMin,
+											__global __ACC__ * partialMax,
+											__global ulong * partialCount)
+					{
+						__local __ACC__ sumL[__GROUP_SIZE__];
+						__local __ACC__ minL[__GROUP_SIZE__];
+						__local __ACC__ maxL[__GROUP_SIZE__];
+						__local ulong countL[__GROUP_SIZE__];
+						const size_t lid = get_local_id(0);
+						const size_t grp = get_group_id(0);
+						const ulong n = *numElement;
+
+						__ACC__ sum = 0;
+						__ACC__ minimum = 0;
+						__ACC__ maximum = 0;
+						ulong count = 0;
+						for(size_t id = get_global_id(0); id < n; id += get_global_size(0))
+						{
+							__global const unsigned char * e = arr + id*__OBJ_SIZE__;
+							if(__CONDITION__)
+							{
+								const __ACC__ m = __MEMBER__;
+								sum += m;
+								minimum = ((count == 0) || (m < minimum))?m:minimum;
+								maximum = ((count == 0) || (m > maximum))?m:maximum;
+								count++;
+							}
+						}
+
+						sumL[lid] = sum;
+						minL[lid] = minimum;
+						maxL[lid] = maximum;
+						countL[lid] = count;
+						barrier(CLK_LOCAL_MEM_FENCE);
+						for(uint s = __GROUP_SIZE__/2; s>0; s>>=1)
+						{
+							if((lid < s) && (countL[lid+s] > 0))
+							{
+								const ulong c = countL[lid];
+								sumL[lid] += sumL[lid+s];
+								minL[lid] = ((c == 0) || (minL[lid+s] < minL[lid]))?minL[lid+s]:minL[lid];
+								maxL[lid] = ((c == 0) || (maxL[lid+s] > maxL[lid]))?maxL[lid+s]:maxL[lid];
+								countL[lid] = c + countL[lid+s];
+							}
+							barrier(CLK_LOCAL_MEM_FENCE);
+						}
+
+						if(lid == 0)
+						{
+							partialSum[grp] = sumL[0];
+							partialMin[grp] = minL[0];
+							partialMax[grp] = maxL[0];
+							partialCount[grp] = countL[0];
+						}
+					}
+				)");
+
+		ClCompute & compute = cachedCompute(code,"reduce",[&](ClCompute & c)
+		{
+			c.addParameter(*ctx,"data buffer",64,0,gpu->getMem());
+			c.addParameter(*ctx,"operand",8,1);
+			c.addParameter(*ctx,"number of elements",sizeof(cl_ulong),2);
+			c.addParameter(*ctx,"partial sum",sizeof(A),3);
+			c.addParameter(*ctx,"partial min",sizeof(A),4);
+			c.addParameter(*ctx,"partial max",sizeof(A),5);
+			c.addParameter(*ctx,"partial count",sizeof(cl_ulong),6);
+		});
+
+		const size_t numGroup = std::max((size_t)1,std::min(REDUCE_MAX_GROUPS,(n + REDUCE_GROUP_SIZE - 1)/REDUCE_GROUP_SIZE));
+		const std::vector<unsigned char> operandData = paddedOperand(operand);
+		fitParameter(compute,"operand",operandData.size(),1);
+		fitParameter(compute,"partial sum",numGroup*sizeof(A),3);
+		fitParameter(compute,"partial min",numGroup*sizeof(A),4);
+		fitParameter(compute,"partial max",numGroup*sizeof(A),5);
+		fitParameter(compute,"partial count",numGroup*sizeof(cl_ulong),6);
+
+		const cl_ulong numElement = n;
+		ReducePartials<A> result;
+		result.sum.resize(numGroup);
+		result.min.resize(numGroup);
+		result.max.resize(numGroup);
+		result.count.resize(numGroup);
+		compute.setArgValueAsync("operand",*q,operandData.data());
+		compute.setArgValueAsync("number of elements",*q,&numElement);
+		compute.runAsync(*q,numGroup*REDUCE_GROUP_SIZE,REDUCE_GROUP_SIZE);
+		compute.getArgValueAsync("partial sum",*q,*result.sum.data());
+		compute.getArgValueAsync("partial min",*q,*result.min.data());
+		compute.getArgValueAsync("partial max",*q,*result.max.data());
+		compute.getArgValueAsync("partial count",*q,*result.count.data());
+		compute.sync(*q);
+		return result;
+	}
+
 	int getNumP()
 	{
 		return nump;
@@ -460,6 +1122,12 @@ private:
 	// number of active pages
 	int nump;
 
+	// number of independent caches, page i is served by cache i%numShard
+	int numShard;
+
+	// pinning of pages allocated when cache grows
+	bool usePinned;
+
 	// opencl device
 	std::unique_ptr<ClDevice> dv;
 
@@ -471,9 +1139,55 @@ private:
 	// shared between all active pages / page cache pages
 	std::shared_ptr<ClCommandQueue> q;
 
+	// opencl queue for background uploads of evicted pages
+	// only created when write-back staging pages are used
+	std::shared_ptr<ClCommandQueue> qWriteBack;
+
 	// kernel + parameters for "find"
 	std::unique_ptr<ClCompute> computeFind;
 
+	// kernels + parameters for "findIf" and "reduce", one per kernel code
+	std::map<std::string,std::unique_ptr<ClCompute>> computeGenerated;
+
+	// compiled kernel of code, built and given its parameters by setup(compute) when it is not cached
+	// at most COMPUTE_KERNEL_CACHE_SIZE kernels are kept, all are released when a new one does not fit
+	template<typename F>
+	ClCompute & cachedCompute(const std::string & code, const std::string & kernelName, F setup)
+	{
+		auto it = computeGenerated.find(code);
+		if(it==computeGenerated.end())
+		{
+			if(computeGenerated.size()>=COMPUTE_KERNEL_CACHE_SIZE)
+			{
+				computeGenerated.clear();
+			}
+
+			std::unique_ptr<ClCompute> compute(new ClCompute(*ctx,*dv,code,kernelName));
+			setup(*compute);
+			compute->setKernelArgs();
+			it = computeGenerated.emplace(code,std::move(compute)).first;
+		}
+		return *it->second;
+	}
+
+	// reallocates a kernel parameter when its size is different
+	void fitParameter(ClCompute & compute, const std::string & name, const size_t bytes, const int index)
+	{
+		if(compute.getArgSizeBytes(name)!=bytes)
+		{
+			compute.addParameter(*ctx,name,bytes,index);
+			compute.setKernelArgs(index);
+		}
+	}
+
+	// operand bytes of a predicate, padded to a multiple of 8 bytes (at least 8, a kernel parameter can not be empty)
+	static std::vector<unsigned char> paddedOperand(const std::vector<unsigned char> & operand)
+	{
+		std::vector<unsigned char> result(operand);
+		result.resize(std::max((size_t)8,((operand.size()+7)/8)*8),0);
+		return result;
+	}
+
 	// opencl buffer in graphics card
 	// shared between all active pages / page cache pages
 	std::shared_ptr<ClArray<T>> gpu;
@@ -482,9 +1196,90 @@ private:
 	// shared between all active pages / page cache pages
 	std::shared_ptr<Page<T>> cpu;
 
+	// copy-on-write state of a running snapshot, shared with cache shards, nullptr when there is none
+	std::shared_ptr<VramSnapshot<T>> snapshot;
+
+	// frozen pages [firstPage,lastPage] are going to be written in vram
+	void preserveForSnapshot(const size_t firstPage, const size_t lastPage) const
+	{
+		if(snapshot)
+		{
+			snapshot->preserve(firstPage,lastPage);
+		}
+	}
+
+	// opencl-pinned staging buffers in RAM for evicted pages that are being uploaded
+	std::shared_ptr<Page<T>> writeBack;
+
+	void allocateWriteBackPages(const int numWriteBackPageP, const bool usePinnedArraysOnly)
+	{
+		if(numWriteBackPageP<=0)
+		{
+			return;
+		}
+
+		qWriteBack = std::make_shared<ClCommandQueue>(*ctx,*dv);
+		writeBack = std::shared_ptr<Page<T>>(new Page<T>[numWriteBackPageP],[](Page<T> * ptr){delete [] ptr;});
+		for(int i=0;i<numWriteBackPageP;i++)
+		{
+			writeBack.get()[i]=Page<T>(szp,*ctx,*qWriteBack,usePinnedArraysOnly);
+		}
+	}
+
+
+	// LRU cache shards
+	std::vector<std::unique_ptr<Cache<T>>> pageCache;
+
+	Cache<T> * cacheOf(const size_t & selectedPage) const noexcept
+	{
+		return pageCache[selectedPage%numShard].get();
+	}
+
+	// splits active pages and write-back staging pages evenly between shards
+	// shard i gets a contiguous slice of them and initially caches pages i, i+numShard, i+2*numShard, ...
+	// every shard gets its own read-ahead staging page
+	// prefetch staging pages are split evenly too
+	void createCacheShards(const bool usePinnedArraysOnly, const bool useLRUdebugging, const int numWriteBackPageP, const EvictionPolicy policy, const int numReadAheadPageP, const int numStagingPageP)
+	{
+		if((numShard<1) || (numShard>nump))
+		{
+			throw std::invalid_argument(std::string("error: number of cache shards (")+std::to_string(numShard)+std::string(") must be between 1 and number of active pages (")+std::to_string(nump)+std::string(")"));
+		}
 
-	// LRU cache
-	std::unique_ptr<Cache<T>> pageCache;
+		checkCacheSize(nump);
+		int activeBegin = 0;
+		int writeBackBegin = 0;
+		for(int i=0;i<numShard;i++)
+		{
+			const int numActiveShard = shardSizeOf(nump,i);
+			const int numWriteBackShard = numWriteBackPageP/numShard + ((i<numWriteBackPageP%numShard)?1:0);
+
+			std::shared_ptr<Page<T>> cpuShard(cpu, cpu.get()+activeBegin);
+			std::shared_ptr<Page<T>> writeBackShard = ((numWriteBackShard>0)?std::shared_ptr<Page<T>>(writeBack, writeBack.get()+writeBackBegin):nullptr);
+			// more pages than slots would evict the missed page itself
+			const int numReadAheadShard = std::max(0,std::min(numReadAheadPageP,numActiveShard-1));
+			std::shared_ptr<Page<T>> readAheadShard = nullptr;
+			if(numReadAheadShard>0)
+			{
+				readAheadShard = std::make_shared<Page<T>>(szp*(numReadAheadShard+1),*ctx,*q,usePinnedArraysOnly);
+			}
+
+			const int numStagingShard = std::max(0,numStagingPageP)/numShard + ((i<std::max(0,numStagingPageP)%numShard)?1:0);
+			std::shared_ptr<Page<T>> stagingShard = nullptr;
+			if(numStagingShard>0)
+			{
+				stagingShard = std::shared_ptr<Page<T>>(new Page<T>[numStagingShard],[](Page<T> * ptr){delete [] ptr;});
+				for(int k=0;k<numStagingShard;k++)
+				{
+					stagingShard.get()[k]=Page<T>(szp,*ctx,*q,usePinnedArraysOnly);
+				}
+			}
+
+			pageCache.push_back(std::make_unique<Cache<T>>(numActiveShard,q, gpu, szp,usePinnedArraysOnly,cpuShard,useLRUdebugging,qWriteBack,writeBackShard,numWriteBackShard,policy,i,numShard,readAheadShard,numReadAheadShard,stagingShard,numStagingShard));
+			activeBegin += numActiveShard;
+			writeBackBegin += numWriteBackShard;
+		}
+	}
 
 };
 
@@ -19,7 +19,9 @@
  *
  * How to hide I/O latency: Using more threads than CPU logical cores when accessing elements with any method except uncached versions
  * 		Currently only Linux support for the I/O latency hiding
- * How to reduce average latency per element for sequential access: use bulk read/write (readOnlyGetN, writeOnlySetN,mappedReadWriteAccess)
+ * 		Threads waiting for a page transfer poll it shortly and then sleep until opencl signals completion
+ * 		(spin length: ClEventWaiter::setSpinCount(), 0 = sleep immediately)
+ * How to reduce average latency per element for sequential access: use bulk read/write (readInto, writeFrom, readOnlyGetN, writeOnlySetN,mappedReadWriteAccess) or iterators (begin(),end())
  * 		Also allocate more(and larger) active pages (cache lines) for higher amounts of threads accessing concurrently
  * How to increase throughput for random-access: decrease page size (cache line size), increase number of active pages (cache lines)
  * How to decrease latency for random-access: use getUncached/setUncached methods between streamStart/streamStop commands.
@@ -31,19 +33,44 @@
 
 #include<limits>
 #include<vector>
+#include<deque>
 #include<memory>
 #include<mutex>
+#include<shared_mutex>
 #include <stdexcept>
 #include <functional>
+#include <chrono>
+#include <algorithm>
+#include <future>
+#include <exception>
+#include <iterator>
+#include <type_traits>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#if __cplusplus >= 202002L
+#include <span>
+#endif
 #include "FunctionRunner.h"
+#include "ThreadPool.h"
+#include "Predicate.h"
 
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
 // windows
 #include<memoryapi.h>
+#include<processthreadsapi.h>
 #define __restrict__ __restrict
 #else
 // linux
 #include<sys/mman.h>
+#include<sys/syscall.h>
+#include<unistd.h>
+#ifdef __NR_membarrier
+#include<linux/membarrier.h>
+#endif
 
 #endif
 
@@ -53,6 +80,92 @@
 #include"ClDevice.h"
 #include"VirtualArray.h"
 
+// number of recently accessed pages remembered per thread (when thread-local page cache is enabled)
+constexpr int THREAD_LOCAL_PAGE_CACHE_SIZE = 4;
+
+// number of arrays whose access pattern is tracked per thread (when automatic prefetching is enabled)
+constexpr int THREAD_LOCAL_ACCESS_PATTERN_SIZE = 4;
+
+// number of consecutive page changes with same stride before automatic prefetching starts
+constexpr int AUTO_PREFETCH_MIN_REPEAT = 2;
+
+// gather/scatter with fewer elements than this run on calling thread only
+constexpr size_t GATHER_SCATTER_PARALLEL_MIN = 4096;
+
+// maximum number of consecutive blocks a thread of parallel algorithms takes at once (parallelForEach, parallelTransform, parallelReduce)
+constexpr size_t PARALLEL_ALGORITHM_MAX_BLOCKS_PER_TASK = 8;
+
+// size of host buffer of copy() between virtual gpus of different cards
+constexpr size_t COPY_BOUNCE_BYTES = 1024*1024*4;
+
+// size of each of the two host staging buffers of loadFromFile/saveToFile (rounded to whole pages of all virtual gpus)
+constexpr size_t FILE_STREAM_CHUNK_BYTES = 1024*1024*16;
+
+// bytes of header of a snapshot file, elements start after it
+constexpr size_t SNAPSHOT_HEADER_BYTES = 64;
+
+// operation of VirtualMultiArray::reduce()
+enum class ReduceOp { Sum, Min, Max, Count, Mean };
+
+// tuning options of VirtualMultiArray constructors, default values keep the behavior of original array
+// set only the ones that are needed:
+//		VirtualMultiArrayOptions options;
+//		options.numCacheShard = 4;
+//		options.useThreadLocalPageCache = true;
+//		VirtualMultiArray<T> arr(size,gpus,pageSize,numActivePage,memMult,mem,usePinned,useLRUdebugging,options);
+struct VirtualMultiArrayOptions
+{
+	// numWriteBackPage: number of staging pages per virtual gpu for evicting edited pages asynchronously
+	//		0 (default) = a cache miss on an edited page waits for both its upload and the download of the new page
+	//		>0 = edited page is copied to a staging page and uploaded in background on a second command queue, cache miss only waits for the download
+	//		(extra RAM usage: nGpu * memMult * pageSize * sizeof(T) * numWriteBackPage)
+	int numWriteBackPage = 0;
+
+	// evictionPolicy: page replacement algorithm of every LRU cache
+	//		EvictionPolicy::Clock2Hand (default) = least book-keeping, good for uniform random or sequential access
+	//		EvictionPolicy::Lru = exact recency order
+	//		EvictionPolicy::Arc, EvictionPolicy::TwoQueue, EvictionPolicy::S3Fifo = scan-resistant, keep hot pages when other threads stream over big regions
+	//		compare them with useLRUdebugging=true and getTotalCacheHitRatio() on the actual workload
+	EvictionPolicy evictionPolicy = EvictionPolicy::Clock2Hand;
+
+	// numCacheShard: number of independent caches (lock stripes) per virtual gpu, all sharing the same command queue and vram buffer
+	//		numActivePage and numWriteBackPage of a virtual gpu are split evenly between its shards
+	//		page k of a virtual gpu is cached by shard k%numCacheShard so threads on different shards do not block each other
+	//		more parallelism without raising memMult (which also multiplies command queues, vram buffers and caches)
+	//		1 (default) = one lock per virtual gpu
+	int numCacheShard = 1;
+
+	// useThreadLocalPageCache: true = every thread remembers last few pages it accessed through get()/set() (per array)
+	//		repeated accesses to same page skip index computation and page lookup, get() also skips the lock
+	//		entries are validated against a version of the page's lock that changes on every eviction or write by another thread
+	//		accesses served this way are not seen by the eviction policy nor counted in cache hit ratio
+	//		false (default) = every access goes through the lock and page lookup
+	bool useThreadLocalPageCache = false;
+
+	// numReadAheadPage: when a page misses while the previous page (of same cache shard) is cached, this many next pages are
+	//		loaded too, together in one larger transfer, into victim slots (fewer and larger pcie transfers for sequential/chunked loops)
+	//		works best when numActivePage >= (threads streaming concurrently) * (numReadAheadPage+1), otherwise loaded pages are evicted before use
+	//		limited to (active pages of shard - 1), extra RAM usage: nGpu * memMult * numCacheShard * (numReadAheadPage+1) * pageSize * sizeof(T)
+	//		0 (default) = every miss loads only its own page
+	int numReadAheadPage = 0;
+
+	// numAutoPrefetchPage: maximum prefetch distance (in pages) of automatic prefetching in get()/set()
+	//		every thread's page changes are tracked per array, once a thread moves with a constant page stride (sequential, backwards or strided loops)
+	//		next pages in that direction are queued to prefetch() automatically
+	//		distance adapts to (measured page load time of prefetcher) / (time the thread spends per page), limited to 1..numAutoPrefetchPage
+	//		needs numActivePage large enough to keep prefetched pages of all streaming threads, same as numReadAheadPage
+	//		0 (default) = only explicit prefetch() calls
+	int numAutoPrefetchPage = 0;
+
+	// numPrefetchStagingPage: number of staging pages per virtual gpu (split between its cache shards) that receive prefetch() and automatic prefetches
+	//		a prefetched page moves into cache only when it is accessed, so speculative prefetches that are never used do not evict cached pages
+	//		oldest staged page is overwritten first, so it should be at least (automatic prefetch distance) / (number of virtual gpus * numCacheShard) per shard
+	//		prefetchRange() always loads into cache
+	//		0 (default) = prefetched pages are loaded directly into cache
+	int numPrefetchStagingPage = 0;
+};
+
+
 
 
 
@@ -76,7 +189,7 @@ public:
 		UsePcieRatios=2
 	};
 
-	VirtualMultiArray():numDevice(0),pageSize(0),va(nullptr),pageLock(nullptr){};
+	VirtualMultiArray():numDevice(0),pageSize(0),numShard(1),numPage(0),useThreadLocalPageCache(false),maxAutoPrefetchDistance(0),arrayId(0),va(nullptr),pageLock(nullptr){};
 
 	// creates virtual array on a list of devices
 	// size: number of array elements (needs to be integer-multiple of pageSize)
@@ -103,9 +216,10 @@ public:
 	// usePinnedArraysOnly: pins all active-page buffers to stop OS paging them in/out while doing gpu copies (pageable buffers are slower but need less *resources*)
 	// useLRUdebugging: true=uses a LRU algorithm that keeps cache hit/miss information for query (performance difference is negligible)
 	//		to query hit ratio, call getTotalCacheHitRatio() and other related methods
+	// options: tuning of caching, prefetching and concurrency (see VirtualMultiArrayOptions), default-constructed options keep the behavior of original array
 	VirtualMultiArray(size_t size, std::vector<ClDevice> device, size_t pageSizeP=1024, int numActivePage=50,
 			std::vector<int> memMult=std::vector<int>(), MemMult mem=MemMult::UseDefault, const bool usePinnedArraysOnly=true,
-			const bool useLRUdebugging=false){
+			const bool useLRUdebugging=false, const VirtualMultiArrayOptions & options=VirtualMultiArrayOptions()){
 		int numPhysicalCard = device.size();
 
 		int nDevice = 0;
@@ -198,10 +312,14 @@ public:
 
 			delete [] ptr;
 		});
-		pageLock = std::shared_ptr<LMutex>(new LMutex[numDevice],[](LMutex * ptr){delete [] ptr;});
+		numShard=options.numCacheShard;
+		useThreadLocalPageCache=options.useThreadLocalPageCache;
+		maxAutoPrefetchDistance=(options.numAutoPrefetchPage<0)?0:options.numAutoPrefetchPage;
+		arrayId=generateArrayId();
+		pageLock = std::shared_ptr<LMutex>(new LMutex[numDevice*numShard],[](LMutex * ptr){delete [] ptr;});
 
 
-		size_t numPage = size/pageSize;
+		numPage = size/pageSize;
 		size_t numInterleave = (numPage/nDevice) + 1;
 		size_t extraAllocDeviceIndex = numPage%nDevice; // 0: all equal, 1: first device extra allocation, 2: second device, ...
 
@@ -235,7 +353,7 @@ public:
 			if(gpuCloneMult[i]>0)
 			{
 				actuallyUsedPhysicalGpuIndex[i]=ctr;
-				va.get()[ctr]=VirtualArray<T>(	((extraAllocDeviceIndex>=ctr)?numInterleave:(numInterleave-1)) 	* pageSize,device[i],pageSize,numActivePage,usePinnedArraysOnly,useLRUdebugging);
+				va.get()[ctr]=VirtualArray<T>(	((extraAllocDeviceIndex>=ctr)?numInterleave:(numInterleave-1)) 	* pageSize,device[i],pageSize,numActivePage,usePinnedArraysOnly,useLRUdebugging,options.numWriteBackPage,options.evictionPolicy,numShard,options.numReadAheadPage,options.numPrefetchStagingPage);
 				ctr++;
 				gpuCloneMult[i]--;
 				ctrPhysicalCard++;
@@ -253,7 +371,7 @@ public:
 				{
 
 					int index = actuallyUsedPhysicalGpuIndex[i];
-					va.get()[ctr]=VirtualArray<T>(	((extraAllocDeviceIndex>= ctr)?numInterleave:(numInterleave-1)) 	* pageSize,va.get()[index].getContext(),device[i],pageSize,numActivePage,usePinnedArraysOnly,useLRUdebugging);
+					va.get()[ctr]=VirtualArray<T>(	((extraAllocDeviceIndex>= ctr)?numInterleave:(numInterleave-1)) 	* pageSize,va.get()[index].getContext(),device[i],pageSize,numActivePage,usePinnedArraysOnly,useLRUdebugging,options.numWriteBackPage,options.evictionPolicy,numShard,options.numReadAheadPage,options.numPrefetchStagingPage);
 					ctr++;
 					gpuCloneMult[i]--;
 					ctrPhysicalCard++;
@@ -263,7 +381,64 @@ public:
 			}
 		}
 
-		funcRun = std::make_shared<Prefetcher<VirtualMultiArray<T>>>(*this);
+		// workers keep only shared parts of array so they do not depend on lifetime of this object (or of its copies)
+		{
+			std::shared_ptr<VirtualArray<T>> vaShared = va;
+			std::shared_ptr<LMutex> lockShared = pageLock;
+			const size_t nVirtualArray = numDevice;
+			const size_t nShard = numShard;
+			const size_t nElement = pageSize;
+			auto load = [vaShared,lockShared,nVirtualArray,nShard,nElement](const size_t selectedPage)
+			{
+				LMutex & lm = lockShared.get()[lockIndexOf(selectedPage,nVirtualArray,nShard)];
+				VirtualArray<T> & vai = vaShared.get()[selectedPage%nVirtualArray];
+				const size_t selectedElement = (selectedPage/nVirtualArray)*nElement;
+				{
+					std::shared_lock<std::shared_mutex> lock(lm.m);
+					if(vai.isCached(selectedElement))
+					{
+						return false;
+					}
+				}
+
+				LExclusiveLock lock(lm);
+				vai.getPage(selectedElement);
+				return true;
+			};
+
+			auto loadHint = [vaShared,lockShared,nVirtualArray,nShard,nElement](const size_t selectedPage)
+			{
+				LMutex & lm = lockShared.get()[lockIndexOf(selectedPage,nVirtualArray,nShard)];
+				VirtualArray<T> & vai = vaShared.get()[selectedPage%nVirtualArray];
+				const size_t selectedElement = (selectedPage/nVirtualArray)*nElement;
+				{
+					std::shared_lock<std::shared_mutex> lock(lm.m);
+					if(vai.isCachedOrStaged(selectedElement))
+					{
+						return false;
+					}
+				}
+
+				LExclusiveLock lock(lm);
+				return vai.stage(selectedElement);
+			};
+
+			funcRun = std::make_shared<Prefetcher>(numDevice,numPage,load,loadHint);
+		}
+	}
+
+	// restores an array from a file written by snapshot(), number of elements comes from the file
+	// other parameters are same as above (they can be different than the ones of the array that wrote the snapshot)
+	// elements are uploaded by all virtual gpus in parallel while next chunk is read from disk (same as loadFromFile)
+	VirtualMultiArray(const std::string & snapshotPath, std::vector<ClDevice> device, size_t pageSizeP=1024, int numActivePage=50,
+			std::vector<int> memMult=std::vector<int>(), MemMult mem=MemMult::UseDefault, const bool usePinnedArraysOnly=true,
+			const bool useLRUdebugging=false, const VirtualMultiArrayOptions & options=VirtualMultiArrayOptions()):VirtualMultiArray(numSnapshotElements(snapshotPath),
+					device, pageSizeP, numActivePage, memMult, mem, usePinnedArraysOnly, useLRUdebugging, options)
+	{
+		if(loadFromFile(snapshotPath,SNAPSHOT_HEADER_BYTES)!=size())
+		{
+			throw std::invalid_argument(std::string("error: snapshot file ")+snapshotPath+std::string(" is truncated"));
+		}
 	}
 
 	int totalGpuChannels()
@@ -279,19 +454,115 @@ public:
 	// get data at index
 	// index: minimum value=0, maximum value=size-1 but not checked for overflowing/underflowing
 	T get(const size_t & index) const{
+		// same page as a recent access of this thread: no division, no lock, no page lookup
+		if(useThreadLocalPageCache)
+		{
+			const ThreadLocalPageEntry * const entry = findThreadLocalPage(index);
+			T result;
+			if((entry!=nullptr) && readView(entry->view,index,result))
+			{
+				return result;
+			}
+		}
+
 		const size_t selectedPage = index/pageSize;
 		const size_t numInterleave = selectedPage/numDevice;
 		const size_t selectedVirtualArray = selectedPage%numDevice;
 		const size_t selectedElement = numInterleave*pageSize + (index%pageSize);
+		const size_t pageElement = index%pageSize;
+		if(maxAutoPrefetchDistance>0)
+		{
+			autoPrefetch(selectedPage);
+		}
+
+		// cache hit: other readers of same virtual gpu are not blocked
+		{
+			std::shared_lock<std::shared_mutex> lock(lockOfPage(selectedPage).m);
+			Page<T> * const page = va.get()[selectedVirtualArray].getPageShared(selectedElement);
+			if(page!=nullptr)
+			{
+				if(useThreadLocalPageCache)
+				{
+					LMutex & lm = lockOfPage(selectedPage);
+					storeThreadLocalPage(PageView{index - pageElement, page, page->ptr(), &lm, lm.version.load(std::memory_order_relaxed)});
+				}
+				return page->ptr()[pageElement];
+			}
+		}
 
-		std::unique_lock<std::mutex> lock(pageLock.get()[selectedVirtualArray].m);
+		// cache miss: exclusive
+		LExclusiveLock lock(lockOfPage(selectedPage));
+		if(useThreadLocalPageCache)
+		{
+			Page<T> * const page = va.get()[selectedVirtualArray].getPage(selectedElement);
+			storeThreadLocalPage(PageView{index - pageElement, page, page->ptr(), &lockOfPage(selectedPage), lock.versionAfterUnlock()});
+			return page->ptr()[pageElement];
+		}
 		return va.get()[selectedVirtualArray].get(selectedElement);
 	}
 
-	// it loads the data page that holds the element at "index" from video-memory into LRU cache (or updates its position in LRU)
+	// asynchronously loads the data page that holds the element at "index" from video-memory into LRU cache
+	// ignored if the page is already cached, already queued, or too many prefetches are pending for its virtual gpu
 	void prefetch(const size_t & index) const
 	{
-		funcRun->push(index);
+		funcRun->push(index/pageSize);
+	}
+
+	// loads pages of elements in [indexBegin,indexEnd) into cache in background, pages of different virtual gpus are loaded in parallel
+	// returned future becomes ready when all pages are cached (rethrows first load error)
+	// pages can be evicted by later accesses as usual, so range should fit in active pages (or be pinned) to be still resident when used
+	// for overlapping computation on chunk k with loading chunk k+1:
+	//		auto next = arr.prefetchRange(k1,k2); compute(k0,k1); next.wait(); compute(k1,k2); ...
+	std::future<void> prefetchRange(const size_t & indexBegin, const size_t & indexEnd) const
+	{
+		std::vector<size_t> pages;
+		for(size_t selectedPage = indexBegin/pageSize; selectedPage*pageSize<indexEnd; selectedPage++)
+		{
+			pages.push_back(selectedPage);
+		}
+		return funcRun->pushBatch(pages);
+	}
+
+	// loads pages of elements in [indexBegin,indexEnd) into cache and excludes them from eviction until unpin()
+	// for hot data that needs predictable latency without increasing numActivePage for all pages
+	// at most 3/4 of active pages of a cache shard can be pinned, exceeding it throws and keeps pin state as before this call
+	// pinning an already pinned page has no effect (no nesting)
+	void pin(const size_t & indexBegin, const size_t & indexEnd) const
+	{
+		std::vector<size_t> newlyPinned;
+		try
+		{
+			for(size_t selectedPage = indexBegin/pageSize; selectedPage*pageSize<indexEnd; selectedPage++)
+			{
+				const size_t numInterleave = selectedPage/numDevice;
+				const size_t selectedVirtualArray = selectedPage%numDevice;
+				const size_t selectedElement = numInterleave*pageSize;
+				LExclusiveLock lock(lockOfPage(selectedPage));
+				if(va.get()[selectedVirtualArray].pin(selectedElement))
+				{
+					newlyPinned.push_back(selectedPage);
+				}
+			}
+		}
+		catch(...)
+		{
+			for(const size_t & selectedPage:newlyPinned)
+			{
+				LExclusiveLock lock(lockOfPage(selectedPage));
+				va.get()[selectedPage%numDevice].unpin((selectedPage/numDevice)*pageSize);
+			}
+			throw;
+		}
+	}
+
+	// pages of elements in [indexBegin,indexEnd) can be evicted again
+	void unpin(const size_t & indexBegin, const size_t & indexEnd) const
+	{
+		for(size_t selectedPage = indexBegin/pageSize; selectedPage*pageSize<indexEnd; selectedPage++)
+		{
+			LExclusiveLock lock(lockOfPage(selectedPage));
+			va.get()[selectedPage%numDevice].unpin((selectedPage/numDevice)*pageSize);
+		}
 	}
 
 	// return average cache hit ratio of all LRUs of array
@@ -300,7 +571,7 @@ public:
 		double result = 0.0;
 		for(int i=0;i<numDevice;i++)
 		{
-			std::unique_lock<std::mutex> lock(pageLock.get()[i].m);
+			auto lock = lockAllShards(i);
 			result += va.get()[i].getCacheHitRatio();
 		}
 		return result/numDevice;
@@ -312,7 +583,7 @@ public:
 
 		for(int i=0;i<numDevice;i++)
 		{
-			std::unique_lock<std::mutex> lock(pageLock.get()[i].m);
+			auto lock = lockAllShards(i);
 			va.get()[i].resetCacheHitRatio();
 		}
 	}
@@ -320,13 +591,38 @@ public:
 	// put data to index
 	// index: minimum value=0, maximum value=size-1 but not checked for overflowing/underflowing
 	void set(const size_t & index, const T & val) const{
+		// same page as a recent access of this thread: no division, no page lookup
+		if(useThreadLocalPageCache)
+		{
+			ThreadLocalPageEntry * const entry = findThreadLocalPage(index);
+			if((entry!=nullptr) && writeView(entry->view,index,val))
+			{
+				return;
+			}
+		}
+
 		const size_t selectedPage = index/pageSize;
 		const size_t numInterleave = selectedPage/numDevice;
 		const size_t selectedVirtualArray = selectedPage%numDevice;
 		const size_t selectedElement = numInterleave*pageSize + (index%pageSize);
+		if(maxAutoPrefetchDistance>0)
+		{
+			autoPrefetch(selectedPage);
+		}
 
-		std::unique_lock<std::mutex> lock(pageLock.get()[selectedVirtualArray].m);
-		va.get()[selectedVirtualArray].set(selectedElement,val);
+		LExclusiveLock lock(lockOfPage(selectedPage));
+		if(useThreadLocalPageCache)
+		{
+			const int pageElement = index%pageSize;
+			Page<T> * const page = va.get()[selectedVirtualArray].getPage(selectedElement);
+			page->edit(pageElement, val);
+			page->markAsEdited(pageElement);
+			storeThreadLocalPage(PageView{index - pageElement, page, page->ptr(), &lockOfPage(selectedPage), lock.versionAfterUnlock()});
+		}
+		else
+		{
+			va.get()[selectedVirtualArray].set(selectedElement,val);
+		}
 	}
 
 	// read N values starting at index
@@ -337,42 +633,9 @@ public:
 	// also safe to use with writes as long as user explicitly orders operations with thread-safe pattern for N>pageSize
 	std::vector<T> readOnlyGetN(const size_t & index, const size_t & n) const
 	{
-		std::vector<T> result;
-		const size_t selectedPage = index/pageSize;
-		const size_t numInterleave = selectedPage/numDevice;
-		const size_t selectedVirtualArray = selectedPage%numDevice;
-		const size_t modIdx = index%pageSize;
-		const size_t selectedElement = numInterleave*pageSize + modIdx;
-		if(modIdx + n - 1 < pageSize)
-		{
-			// full read possible
-			std::unique_lock<std::mutex> lock(pageLock.get()[selectedVirtualArray].m);
-			return va.get()[selectedVirtualArray].getN(selectedElement,n);
-		}
-		else
-		{
-			size_t nToRead = n;
-			size_t maxThisPage = pageSize - modIdx;
-			size_t toBeCopied = ((nToRead<maxThisPage)? nToRead: maxThisPage);
-
-			// read this page
-			{
-				std::unique_lock<std::mutex> lock(pageLock.get()[selectedVirtualArray].m);
-				std::vector<T> part = va.get()[selectedVirtualArray].getN(selectedElement,toBeCopied);
-				std::move(part.begin(),part.end(),std::back_inserter(result));
-				nToRead -= toBeCopied;
-			}
-
-			// repeat for other pages recursively
-			if(nToRead>0)
-			{
-				std::vector<T> part = readOnlyGetN(index+toBeCopied, nToRead);
-				std::move(part.begin(),part.end(),std::back_inserter(result));
-			}
-
-
-			return result;
-		}
+		std::vector<T> result(n);
+		readInto(index,result.data(),n);
+		return result;
 	}
 
 
@@ -387,38 +650,108 @@ public:
 	void writeOnlySetN(const size_t & index, const std::vector<T> & val, const size_t & valIndex=0, const size_t & nVal=(size_t)-1) const
 	{
 		const size_t n = ((nVal==(size_t)-1)?val.size():nVal);
-		const size_t selectedPage = index/pageSize;
-		const size_t numInterleave = selectedPage/numDevice;
-		const size_t selectedVirtualArray = selectedPage%numDevice;
-		const size_t modIdx = index%pageSize;
-		const size_t selectedElement = numInterleave*pageSize + modIdx;
-		if(modIdx + n - 1 < pageSize)
+		writeFrom(index,val.data()+valIndex,n);
+	}
+
+	// reads n elements starting at index into out, page by page, without allocating
+	// same thread-safety as readOnlyGetN (page-level, not n-level)
+	// out: at least n elements
+	void readInto(const size_t & index, T * const out, const size_t & n) const
+	{
+		size_t currentIndex = index;
+		size_t done = 0;
+		while(done<n)
 		{
-			// full write possible
-			std::unique_lock<std::mutex> lock(pageLock.get()[selectedVirtualArray].m);
-			va.get()[selectedVirtualArray].setN(selectedElement,val,valIndex,n);
+			const size_t selectedPage = currentIndex/pageSize;
+			const size_t modIdx = currentIndex%pageSize;
+			const size_t currentRange = std::min(n-done,pageSize-modIdx);
+			const size_t selectedVirtualArray = selectedPage%numDevice;
+			const size_t selectedElement = (selectedPage/numDevice)*pageSize + modIdx;
+			bool hit = false;
+			{
+				std::shared_lock<std::shared_mutex> lock(lockOfPage(selectedPage).m);
+				hit = va.get()[selectedVirtualArray].copyToBufferShared(selectedElement,currentRange,out+done);
+			}
+
+			if(!hit)
+			{
+				LExclusiveLock lock(lockOfPage(selectedPage));
+				va.get()[selectedVirtualArray].copyToBuffer(selectedElement,currentRange,out+done);
+			}
+			done += currentRange;
+			currentIndex += currentRange;
 		}
-		else
+	}
+
+	// writes n elements from in starting at index, page by page, without allocating
+	// same thread-safety as writeOnlySetN (page-level, not n-level)
+	// in: at least n elements
+	void writeFrom(const size_t & index, const T * const in, const size_t & n) const
+	{
+		size_t currentIndex = index;
+		size_t done = 0;
+		while(done<n)
 		{
-			size_t nToWrite = n;
-			size_t maxThisPage = pageSize - modIdx;
-			size_t toBeCopied = ((nToWrite<maxThisPage)? nToWrite: maxThisPage);
+			const size_t selectedPage = currentIndex/pageSize;
+			const size_t modIdx = currentIndex%pageSize;
+			const size_t currentRange = std::min(n-done,pageSize-modIdx);
+			const size_t selectedVirtualArray = selectedPage%numDevice;
+			const size_t selectedElement = (selectedPage/numDevice)*pageSize + modIdx;
+			{
+				LExclusiveLock lock(lockOfPage(selectedPage));
+				va.get()[selectedVirtualArray].copyFromBuffer(selectedElement,currentRange,in+done);
+			}
+			done += currentRange;
+			currentIndex += currentRange;
+		}
+	}
 
-			// write this page
+	// reads elements of n arbitrary indices: out[i] = element at idx[i]
+	// indices are grouped by virtual gpu and page: every distinct page is locked (and loaded if not cached) once for all of its elements
+	// virtual gpus are served in parallel when n >= GATHER_SCATTER_PARALLEL_MIN
+	// page-level thread-safety (same as readInto)
+	void gather(const size_t * const idx, const size_t n, T * const out) const
+	{
+		forEachPageGroup(idx,n,false,[&](Page<T> * const page, const std::pair<size_t,size_t> * const group, const size_t count)
+		{
+			for(size_t k=0;k<count;k++)
 			{
-				std::unique_lock<std::mutex> lock(pageLock.get()[selectedVirtualArray].m);
-				va.get()[selectedVirtualArray].setN(selectedElement,val,valIndex, toBeCopied);
-				nToWrite -= toBeCopied;
+				const size_t pos = group[k].second;
+				out[pos] = page->get(idx[pos]%pageSize);
 			}
+		});
+	}
 
-			// repeat for other pages recursively
-			if(nToWrite>0)
+	// writes elements of n arbitrary indices: element at idx[i] = in[i]
+	// same grouping as gather, a duplicate index gets the value of its last occurrence in idx
+	// page-level thread-safety (same as writeFrom)
+	void scatter(const size_t * const idx, const size_t n, const T * const in) const
+	{
+		forEachPageGroup(idx,n,true,[&](Page<T> * const page, const std::pair<size_t,size_t> * const group, const size_t count)
+		{
+			for(size_t k=0;k<count;k++)
 			{
-				writeOnlySetN(index+toBeCopied, val, valIndex+toBeCopied, nToWrite);
+				const size_t pos = group[k].second;
+				const int pageElement = idx[pos]%pageSize;
+				page->edit(pageElement, in[pos]);
+				page->markAsEdited(pageElement);
 			}
+		});
+	}
 
-		}
+#if __cplusplus >= 202002L
+	// reads out.size() elements starting at index
+	void readInto(const size_t & index, std::span<T> out) const
+	{
+		readInto(index,out.data(),out.size());
+	}
+
+	// writes in.size() elements starting at index
+	void writeFrom(const size_t & index, std::span<const T> in) const
+	{
+		writeFrom(index,in.data(),in.size());
 	}
+#endif
 
 
 
@@ -435,12 +768,17 @@ public:
 	//               if userPtr != nullptr, userPtr is used as internal data copies and is not same address value given to the user function
 	//               		array.mappedReadWriteAccess(...[&](T * ptr){  ..compute using ptr[some_index] but not myRawPointer[some_index]..  },myRawPointer);
 	//               userPtr needs to be valid between (T *) index and (T *) index + range
+	// bypassCache: true=data is transferred directly between vram and buffer, on all virtual gpus at the same time (one transfer per virtual gpu for full pages)
+	//               cached pages are not evicted: edited cached pages in range are uploaded before reading, cached copies are updated by writing
+	//               all cache shards of a virtual gpu are locked only while its transfers are enqueued
+	//               for big ranges (many pages per virtual gpu), false (default) = data goes through cache page by page
 	void mappedReadWriteAccess(const size_t index, const size_t range,
 								std::function<void(T * const)> f,
 								const bool pinBuffer=false,
 								const bool read=true,
 								const bool write=true,
-								T * const userPtr=nullptr) const
+								T * const userPtr=nullptr,
+								const bool bypassCache=false) const
 	{
 
 		struct TempMem
@@ -458,11 +796,12 @@ public:
 		{
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
 // windows
-			arr = std::unique_ptr<T,void(*)(void *)>((T *)_aligned_malloc(/* (index*sizeof(T))%4096*/ sizeof(T)*range,4096),_aligned_free);
+			arr = std::unique_ptr<T,void(*)(void *)>((T *)_aligned_malloc(/* (index*sizeof(T))%4096*/ mappedBytes(range),4096),_aligned_free);
 
 #else
 // linux
-			arr = std::unique_ptr<T,void(*)(void *)>((T *)aligned_alloc(/* (index*sizeof(T))%4096*/ 4096,sizeof(T)*range),free);
+			// size has to be a multiple of alignment
+			arr = std::unique_ptr<T,void(*)(void *)>((T *)aligned_alloc(/* (index*sizeof(T))%4096*/ 4096,mappedBytes(range)),free);
 #endif
 
 
@@ -479,14 +818,14 @@ public:
 		{
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
 // windows
-			if(0==VirtualLock(mem.buf,range))
+			if(0==VirtualLock(mem.buf,sizeof(T)*range))
 			{
 				throw std::invalid_argument("Error: memory pinning failed.");
 			}
 
 #else
 // linux
-			if(ENOMEM==mlock(mem.buf,range))
+			if(ENOMEM==mlock(mem.buf,sizeof(T)*range))
 			{
 				throw std::invalid_argument("Error: memory pinning failed.");
 			}
@@ -498,34 +837,13 @@ public:
 		// get data from gpu
 		if(read)
 		{
-			size_t indexStartPage = index / pageSize;
-			size_t indexEndPage = (index+range)/pageSize;
-			size_t currentIndex = index;
-			size_t remainingRange = range;
-			size_t remainingPageElm = pageSize;
-			size_t currentRange = 0;
-			size_t currentBufElm = 0;
-			for(size_t selectedPage = indexStartPage; selectedPage<=indexEndPage; selectedPage++)
+			if(bypassCache)
 			{
-				remainingPageElm = pageSize - (currentIndex % pageSize);
- 
-				currentRange = ((remainingRange<remainingPageElm)? remainingRange: remainingPageElm);
-
-				const size_t selectedVirtualArray = selectedPage%numDevice;
-				const size_t numInterleave = selectedPage/numDevice;
-				const size_t selectedElement = numInterleave*pageSize + (currentIndex%pageSize);
-				if(currentRange>0)
-				{
-					std::unique_lock<std::mutex> lock(pageLock.get()[selectedVirtualArray].m);
-					va.get()[selectedVirtualArray].copyToBuffer(selectedElement, currentRange, mem.buf+currentBufElm);
-				}
-				else
-				{
-					break;
-				}
-				currentBufElm += currentRange;
-				currentIndex += currentRange;
-				remainingRange -= currentRange;
+				forEachVirtualGpuParallel([&](const size_t selectedVirtualArray){ mappedDirect(selectedVirtualArray,index,range,mem.buf,false); });
+			}
+			else
+			{
+				readInto(index,mem.buf,range);
 			}
 		}
 
@@ -536,33 +854,13 @@ public:
 		// get data to gpu
 		if(write)
 		{
-			size_t indexStartPage = index / pageSize;
-			size_t indexEndPage = (index+range)/pageSize;
-			size_t currentIndex = index;
-			size_t remainingRange = range;
-			size_t remainingPageElm = pageSize;
-			size_t currentRange = 0;
-			size_t currentBufElm = 0;
-			for(size_t selectedPage = indexStartPage; selectedPage<=indexEndPage; selectedPage++)
+			if(bypassCache)
 			{
-				remainingPageElm = pageSize - (currentIndex % pageSize);
-				currentRange = ((remainingRange<remainingPageElm)? remainingRange: remainingPageElm);
-
-				const size_t selectedVirtualArray = selectedPage%numDevice;
-				const size_t numInterleave = selectedPage/numDevice;
-				const size_t selectedElement = numInterleave*pageSize + (currentIndex%pageSize);
-				if(currentRange>0)
-				{
-					std::unique_lock<std::mutex> lock(pageLock.get()[selectedVirtualArray].m);
-					va.get()[selectedVirtualArray].copyFromBuffer(selectedElement, currentRange, mem.buf+currentBufElm);
-				}
-				else
-				{
-					break;
-				}
-				currentBufElm += currentRange;
-				currentIndex += currentRange;
-				remainingRange -= currentRange;
+				forEachVirtualGpuParallel([&](const size_t selectedVirtualArray){ mappedDirect(selectedVirtualArray,index,range,mem.buf,true); });
+			}
+			else
+			{
+				writeFrom(index,mem.buf,range);
 			}
 		}
 
@@ -571,130 +869,561 @@ public:
 		{
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
 // windows
-			VirtualUnlock(mem.buf,range);
+			VirtualUnlock(mem.buf,sizeof(T)*range);
 
 #else
 // linux
-			munlock(mem.buf,range);
+			munlock(mem.buf,sizeof(T)*range);
 #endif
 
 		}
 	}
 
-	// get data directly from vram, bypassing LRU cache
-	// if streamStart() was not called before uncached stream-read commands, then uncached data will not be guaranteed to be updated
-	// not thread-safe for overlapping regions
-	T getUncached(const size_t index) const
+	// sets elements [indexBegin,indexEnd) to val inside vram (clEnqueueFillBuffer), virtual gpus in parallel, element data does not cross pcie
+	// cached pages of range are filled in RAM too (without becoming edited), fill(0,size(),T()) zero-initializes an array
+	// page-level thread-safety (same as mappedReadWriteAccess with bypassCache=true)
+	void fill(const size_t indexBegin, const size_t indexEnd, const T & val) const
 	{
-		const size_t selectedPage = index/pageSize;
-		const size_t numInterleave = selectedPage/numDevice;
-		const size_t selectedVirtualArray = selectedPage%numDevice;
-		const size_t selectedElement = numInterleave*pageSize + (index%pageSize);
-		std::unique_lock<std::mutex> lock(pageLock.get()[selectedVirtualArray].m);
-		return va.get()[selectedVirtualArray].getUncached(selectedElement);
+		if((indexBegin>indexEnd) || (indexEnd>size()))
+		{
+			throw std::invalid_argument(std::string("error: fill range [")+std::to_string(indexBegin)+std::string(",")+std::to_string(indexEnd)+
+					std::string(") is out of array of size ")+std::to_string(size()));
+		}
+		forEachVirtualGpuParallel([&](const size_t selectedVirtualArray){ fillDirect(selectedVirtualArray,indexBegin,indexEnd-indexBegin,val); });
 	}
 
-	// set data directly to vram, bypassing LRU cache
-	// if streamStop() was not called after uncached stream-write commands, then cached data after this will not be guaranteed to be updated
-	// not thread-safe for overlapping regions
-	void setUncached(const size_t index, const T& val ) const
+	// copies n elements of src starting at srcBegin to this array starting at dstBegin, virtual gpus of this array in parallel
+	// vram-to-vram (clEnqueueCopyBuffer) where source and destination pages are on same card, through a host buffer where they are not
+	// src can be this array (or a copy of it) when ranges do not overlap, overlapping ranges throw
+	// edited cached pages of source range are uploaded first, cached pages of destination range are downloaded again after copy
+	// not atomic: source range should not be written and destination range should not be accessed by other threads during copy
+	void copy(const VirtualMultiArray<T> & src, const size_t srcBegin, const size_t dstBegin, const size_t n) const
 	{
-		const size_t selectedPage = index/pageSize;
-		const size_t numInterleave = selectedPage/numDevice;
-		const size_t selectedVirtualArray = selectedPage%numDevice;
-		const size_t selectedElement = numInterleave*pageSize + (index%pageSize);
-		std::unique_lock<std::mutex> lock(pageLock.get()[selectedVirtualArray].m);
-		va.get()[selectedVirtualArray].setUncached(selectedElement,val);
-	}
+		if((srcBegin+n>src.size()) || (dstBegin+n>size()))
+		{
+			throw std::invalid_argument(std::string("error: copy of ")+std::to_string(n)+std::string(" elements from ")+std::to_string(srcBegin)+
+					std::string(" to ")+std::to_string(dstBegin)+std::string(" is out of array"));
+		}
 
-	// writes all edited active pages to vram
-	// resets all active pages
-	// use this before a series of uncached reads/writes
-	void streamStart()
-	{
-		std::vector<std::thread> parallel;
-		for(int i=0;i<numDevice;i++)
+		if((src.va==va) && (srcBegin<dstBegin+n) && (dstBegin<srcBegin+n) && (n>0))
 		{
-			parallel.push_back(std::thread([&,i]()
-			{
-				std::unique_lock<std::mutex> lock(pageLock.get()[i].m);
-				size_t nump = va.get()[i].getNumP();
-				for(size_t pg = 0;pg<nump;pg++)
-				{
-					va.get()[i].flushPage(pg);
-				}
-			}));
+			throw std::invalid_argument("error: copy within same array with overlapping ranges");
 		}
-		for(int i=0;i<numDevice;i++)
+
+		if(n==0)
 		{
-			if(parallel[i].joinable())
-			{
-				parallel[i].join();
-			}
+			return;
 		}
-	}
 
-	// reloads all edited frozen pages from vram to active pages (LRU cache)
-	// resets all active pages
-	// overwrites any cached writes happened before
-	// use this after a series of uncached reads/writes
-	void streamStop()
-	{
-		std::vector<std::thread> parallel;
-		for(int i=0;i<numDevice;i++)
+		// source vram is made up to date
+		src.forEachVirtualGpuParallel([&](const size_t selectedVirtualArray)
 		{
-			parallel.push_back(std::thread([&,i]()
+			size_t p0 = 0;
+			size_t pN = 0;
+			if(src.pagesOfVirtualGpu(selectedVirtualArray,srcBegin,n,p0,pN))
 			{
-				std::unique_lock<std::mutex> lock(pageLock.get()[i].m);
-				size_t nump = va.get()[i].getNumP();
-				for(size_t pg = 0;pg<nump;pg++)
-				{
-					va.get()[i].reloadPage(pg);
-				}
-			}));
-		}
-		for(int i=0;i<numDevice;i++)
+				auto lock = src.lockAllShards(selectedVirtualArray);
+				src.va.get()[selectedVirtualArray].flushPages(p0/src.numDevice,pN/src.numDevice);
+				src.va.get()[selectedVirtualArray].finish();
+			}
+		});
+
+		// pieces that are in one page of both arrays, merged while they continue in vram of both
+		std::vector<std::vector<CopySegment>> segment(numDevice);
+		for(size_t k=0;k<n;)
 		{
-			if(parallel[i].joinable())
+			const size_t i = srcBegin+k;
+			const size_t j = dstBegin+k;
+			const size_t m = std::min({n-k, src.pageSize - i%src.pageSize, pageSize - j%pageSize});
+			const size_t srcPage = i/src.pageSize;
+			const size_t dstPage = j/pageSize;
+			const CopySegment seg{srcPage%src.numDevice, (srcPage/src.numDevice)*src.pageSize + i%src.pageSize, (dstPage/numDevice)*pageSize + j%pageSize, m};
+			std::vector<CopySegment> & list = segment[dstPage%numDevice];
+			if(!list.empty() && (list.back().srcVirtualArray==seg.srcVirtualArray) &&
+					(list.back().srcElement+list.back().n==seg.srcElement) && (list.back().dstElement+list.back().n==seg.dstElement))
 			{
-				parallel[i].join();
+				list.back().n += m;
 			}
+			else
+			{
+				list.push_back(seg);
+			}
+			k += m;
 		}
-	}
-
 
+		forEachVirtualGpuParallel([&](const size_t selectedVirtualArray){ copyDirect(src,selectedVirtualArray,dstBegin,n,segment[selectedVirtualArray]); });
+	}
 
-	// using gpu compute power, finds an element with given member value, returns its index
-	// obj: object instance
-	// member: member of object to be used for searching value
-	// indexListMaxSize: maximum number of indices found
-	template<typename S>
-	std::vector<size_t> find(T & obj, S & member, const int indexListMaxSize=1)
+	// reads elements from binary file starting at byte offset, into the array starting at element 0, returns number of elements read
+	// reads min(size(), (file size - offset)/sizeof(T)) elements, rest of array is not changed
+	// file is read in chunks of whole pages into two pinned staging buffers: while a chunk is written to vram
+	// (all virtual gpus in parallel, same as mappedReadWriteAccess with bypassCache=true) next chunk is read from disk
+	// cached pages of range are updated (without becoming edited)
+	size_t loadFromFile(const std::string & path, const size_t offset=0) const
 	{
-		//throw std::invalid_argument("Error: find method not implemented.");
-		size_t adrObj = (size_t) &obj;
-		size_t adrMem = (size_t) &member;
-		size_t offset = adrMem - adrObj; // how many bytes the member is found after
-		std::vector<size_t> results;
-
-		// 1) flush all active pages, expect user not to touch any element during search
-		// 2) run search on all gpus on all of their data
-		// 3) return index
+		std::ifstream file(path,std::ios::binary|std::ios::ate);
+		if(!file)
+		{
+			throw std::invalid_argument(std::string("error: cannot open file ")+path);
+		}
 
-		std::vector<std::thread> parallel;
+		const size_t fileBytes = (size_t)file.tellg();
+		if(offset>fileBytes)
+		{
+			throw std::invalid_argument(std::string("error: offset ")+std::to_string(offset)+std::string(" is beyond end of file ")+path+
+					std::string(" (")+std::to_string(fileBytes)+std::string(" bytes)"));
+		}
 
+		const size_t n = std::min(size(),(fileBytes-offset)/sizeof(T));
+		if(n==0)
+		{
+			return 0;
+		}
+		file.seekg(offset);
 
-		std::mutex mGlobal;
-		for(int i=0;i<numDevice;i++)
+		const size_t chunk = fileStreamChunk();
+		StagingBuffer buf[2]={StagingBuffer(chunk),StagingBuffer(chunk)};
+		auto readChunk = [&](const size_t k)
 		{
-			parallel.push_back(std::thread([&,i]()
+			const size_t num = std::min(chunk,n-k*chunk);
+			if(!file.read((char *)buf[k%2].get(),num*sizeof(T)))
 			{
-				std::unique_lock<std::mutex> lock(pageLock.get()[i].m);
-				size_t nump = va.get()[i].getNumP();
-				for(size_t pg = 0;pg<nump;pg++)
-				{
-					va.get()[i].flushPage(pg);
+				throw std::invalid_argument(std::string("error: reading file ")+path+std::string(" failed"));
+			}
+		};
+
+		const size_t numChunk = (n+chunk-1)/chunk;
+		std::future<void> reading = std::async(std::launch::async,readChunk,0);
+		for(size_t k=0;k<numChunk;k++)
+		{
+			reading.get();
+			if(k+1<numChunk)
+			{
+				reading = std::async(std::launch::async,readChunk,k+1);
+			}
+
+			const size_t index = k*chunk;
+			const size_t num = std::min(chunk,n-index);
+			forEachVirtualGpuParallel([&](const size_t selectedVirtualArray){ mappedDirect(selectedVirtualArray,index,num,buf[k%2].get(),true); });
+		}
+		return n;
+	}
+
+	// writes all elements to binary file (created or truncated), size()*sizeof(T) bytes
+	// same double buffering as loadFromFile: while a chunk is written to disk next chunk is read from vram of all virtual gpus
+	// edited cached pages are uploaded before their chunk is read (they stay cached)
+	void saveToFile(const std::string & path) const
+	{
+		std::ofstream file(path,std::ios::binary|std::ios::trunc);
+		if(!file)
+		{
+			throw std::invalid_argument(std::string("error: cannot open file ")+path);
+		}
+
+		const size_t n = size();
+		if(n==0)
+		{
+			return;
+		}
+		const size_t chunk = fileStreamChunk();
+		StagingBuffer buf[2]={StagingBuffer(chunk),StagingBuffer(chunk)};
+		auto writeChunk = [&](const size_t k)
+		{
+			const size_t num = std::min(chunk,n-k*chunk);
+			if(!file.write((const char *)buf[k%2].get(),num*sizeof(T)))
+			{
+				throw std::invalid_argument(std::string("error: writing file ")+path+std::string(" failed"));
+			}
+		};
+
+		const size_t numChunk = (n+chunk-1)/chunk;
+		std::future<void> writing;
+		for(size_t k=0;k<numChunk;k++)
+		{
+			const size_t index = k*chunk;
+			const size_t num = std::min(chunk,n-index);
+			forEachVirtualGpuParallel([&](const size_t selectedVirtualArray){ mappedDirect(selectedVirtualArray,index,num,buf[k%2].get(),false); });
+
+			if(writing.valid())
+			{
+				writing.get();
+			}
+			writing = std::async(std::launch::async,writeChunk,k);
+		}
+
+		if(writing.valid())
+		{
+			writing.get();
+		}
+
+		if(!file.flush())
+		{
+			throw std::invalid_argument(std::string("error: writing file ")+path+std::string(" failed"));
+		}
+	}
+
+	// saves all elements to a snapshot file in background, returned future becomes ready when file is complete (or rethrows its error)
+	// file holds the elements as they were when snapshot() was called, while the array can be used by any method during the snapshot:
+	//		all virtual gpus are locked at once to upload edited cached pages (stop-the-world, only for the duration of these uploads)
+	//		then frozen pages are saved in chunks, a page that is written in vram before it is saved is copied to RAM first (copy-on-write)
+	//		(extra RAM usage: pageSize * sizeof(T) for every page that is overwritten before it is saved)
+	// a virtual gpu is locked while its part of a chunk is read from vram (chunks are FILE_STREAM_CHUNK_BYTES for all virtual gpus)
+	// file is written to path + ".tmp" and renamed to path when complete, so that an earlier snapshot is not lost on a crash
+	// file: SNAPSHOT_HEADER_BYTES bytes of header, then elements (loadFromFile(path, SNAPSHOT_HEADER_BYTES) reads them too)
+	// array is restored by the constructor that takes a snapshot file, only one snapshot of an array can run at a time
+	// destructor of returned future waits for the snapshot (it should be kept until the snapshot is not needed to run in background)
+	std::future<void> snapshot(const std::string & path) const
+	{
+		const std::string tmpPath = path + std::string(".tmp");
+		std::ofstream file(tmpPath,std::ios::binary|std::ios::trunc);
+		if(!file)
+		{
+			throw std::invalid_argument(std::string("error: cannot open file ")+tmpPath);
+		}
+
+		// magic, element size, number of elements
+		char header[SNAPSHOT_HEADER_BYTES]={0};
+		const uint64_t elementBytes = sizeof(T);
+		const uint64_t numElements = size();
+		std::memcpy(header,"VMASNAP1",8);
+		std::memcpy(header+8,&elementBytes,8);
+		std::memcpy(header+16,&numElements,8);
+		if(!file.write(header,SNAPSHOT_HEADER_BYTES))
+		{
+			throw std::invalid_argument(std::string("error: writing file ")+tmpPath+std::string(" failed"));
+		}
+
+		{
+			std::vector<std::deque<LExclusiveLock>> lock;
+			lock.reserve(numDevice);
+			for(size_t i=0;i<numDevice;i++)
+			{
+				lock.push_back(lockAllShards(i));
+				if(va.get()[i].snapshotRunning())
+				{
+					throw std::invalid_argument("error: snapshot is already running");
+				}
+			}
+
+			for(size_t i=0;i<numDevice;i++)
+			{
+				va.get()[i].flushAllPages();
+				va.get()[i].finish();
+			}
+
+			for(size_t i=0;i<numDevice;i++)
+			{
+				va.get()[i].beginSnapshot();
+			}
+		}
+
+		// copy keeps virtual gpus alive if this array is destroyed before snapshot completes
+		const VirtualMultiArray<T> arr = *this;
+		try
+		{
+			return std::async(std::launch::async,[arr,path,tmpPath,file=std::move(file)]() mutable
+			{
+				arr.writeSnapshot(file,tmpPath);
+				file.close();
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
+// windows
+				std::remove(path.c_str());
+#endif
+				if(0!=std::rename(tmpPath.c_str(),path.c_str()))
+				{
+					throw std::invalid_argument(std::string("error: renaming ")+tmpPath+std::string(" to ")+path+std::string(" failed"));
+				}
+			});
+		}
+		catch(...)
+		{
+			for(size_t i=0;i<numDevice;i++)
+			{
+				auto lock = lockAllShards(i);
+				va.get()[i].endSnapshot();
+			}
+			throw;
+		}
+	}
+
+	// f(element) for every element, in parallel on the shared thread pool (ThreadPool.h)
+	// f takes T& to change elements: pages whose bytes were changed are written back, unchanged pages are not
+	// work is split by blocks of whole pages, every block is read into a private buffer while next block of same thread is prefetched
+	// only page-level thread-safety (same as mappedReadWriteAccess): concurrent writes to a page between its read and write-back are lost
+	template<typename F>
+	void parallelForEach(F f) const
+	{
+		forEachBlockParallel(true,[&](const size_t /* block */, const size_t /* index */, T * const buf, const size_t n)
+		{
+			for(size_t i=0;i<n;i++)
+			{
+				f(buf[i]);
+			}
+		});
+	}
+
+	// out[i] = f(element i) for every element, in parallel (same block scheme as parallelForEach)
+	// out: array with same number of elements, can be this array (or a copy of it) to transform in place
+	template<typename R, typename F>
+	void parallelTransform(const VirtualMultiArray<R> & out, F f) const
+	{
+		if(out.size()!=size())
+		{
+			throw std::invalid_argument(std::string("error: output array size (")+std::to_string(out.size())+
+					std::string(") is not equal to input array size (")+std::to_string(size())+std::string(")"));
+		}
+
+		if constexpr (std::is_same<R,T>::value)
+		{
+			if(out.va==va)
+			{
+				forEachBlockParallel(true,[&](const size_t /* block */, const size_t /* index */, T * const buf, const size_t n)
+				{
+					for(size_t i=0;i<n;i++)
+					{
+						buf[i] = f(buf[i]);
+					}
+				});
+				return;
+			}
+		}
+
+		forEachBlockParallel(false,[&](const size_t /* block */, const size_t index, T * const buf, const size_t n)
+		{
+			std::vector<R> result(n);
+			for(size_t i=0;i<n;i++)
+			{
+				result[i] = f(buf[i]);
+			}
+			out.writeFrom(index,result.data(),n);
+		});
+	}
+
+	// reduce(...reduce(reduce(init, transform(element 0)), transform(element 1))...) in parallel (same block scheme as parallelForEach)
+	// blocks are reduced independently and their results are combined in index order with reduce(R,R), so reduce needs to be associative
+	// transform: element -> R, reduce: (R,R) -> R
+	template<typename R, typename Reduce, typename Transform>
+	R parallelReduce(const R & init, Reduce reduce, Transform transform) const
+	{
+		std::mutex partialMut;
+		std::vector<std::pair<size_t,R>> partial;
+		forEachBlockParallel(false,[&](const size_t block, const size_t /* index */, T * const buf, const size_t n)
+		{
+			R result = transform(buf[0]);
+			for(size_t i=1;i<n;i++)
+			{
+				result = reduce(result,transform(buf[i]));
+			}
+			std::unique_lock<std::mutex> lck(partialMut);
+			partial.emplace_back(block,result);
+		});
+
+		std::sort(partial.begin(),partial.end(),[](const std::pair<size_t,R> & a, const std::pair<size_t,R> & b){ return a.first<b.first; });
+		R result = init;
+		for(const auto & p:partial)
+		{
+			result = reduce(result,p.second);
+		}
+		return result;
+	}
+
+	// reduce over elements converted to R, reduce: (R,R) -> R (for example std::plus<T>() with R=T)
+	// T needs to be convertible to R, for a fold with a different element type use the overload with transform
+	template<typename R, typename Reduce>
+	R parallelReduce(const R & init, Reduce reduce) const
+	{
+		static_assert(std::is_convertible<T,R>::value,"element type needs to be convertible to result type of parallelReduce");
+		return parallelReduce(init,reduce,[](const T & e){ return R(e); });
+	}
+
+	// get data directly from vram, bypassing LRU cache
+	// if streamStart() was not called before uncached stream-read commands, then uncached data will not be guaranteed to be updated
+	// not thread-safe for overlapping regions
+	T getUncached(const size_t index) const
+	{
+		const size_t selectedPage = index/pageSize;
+		const size_t numInterleave = selectedPage/numDevice;
+		const size_t selectedVirtualArray = selectedPage%numDevice;
+		const size_t selectedElement = numInterleave*pageSize + (index%pageSize);
+
+		// uncached reads do not touch cache so they can run concurrently
+		{
+			std::shared_lock<std::shared_mutex> lock(lockOfPage(selectedPage).m);
+			if(!va.get()[selectedVirtualArray].writeBackInFlight(selectedElement))
+			{
+				return va.get()[selectedVirtualArray].getUncached(selectedElement);
+			}
+		}
+
+		// background uploads of evicted pages have to be completed first
+		LExclusiveLock lock(lockOfPage(selectedPage));
+		va.get()[selectedVirtualArray].finishWriteBack(selectedElement);
+		return va.get()[selectedVirtualArray].getUncached(selectedElement);
+	}
+
+	// set data directly to vram, bypassing LRU cache
+	// if streamStop() was not called after uncached stream-write commands, then cached data after this will not be guaranteed to be updated
+	// not thread-safe for overlapping regions
+	void setUncached(const size_t index, const T& val ) const
+	{
+		const size_t selectedPage = index/pageSize;
+		const size_t numInterleave = selectedPage/numDevice;
+		const size_t selectedVirtualArray = selectedPage%numDevice;
+		const size_t selectedElement = numInterleave*pageSize + (index%pageSize);
+		LExclusiveLock lock(lockOfPage(selectedPage));
+		va.get()[selectedVirtualArray].setUncached(selectedElement,val);
+	}
+
+	// changes number of active pages per virtual gpu (same meaning as numActivePage of constructor) while array is in use
+	// growing: new pages are allocated without holding any lock, then added as empty slots that next misses fill
+	// shrinking: one active page per lock acquisition is evicted (uploaded if edited),
+	//		so that concurrent readers/writers wait for at most one page upload
+	//		RAM of evicted pages is freed once lock-free reads (thread-local page cache, iterators) that may be using them are complete
+	// eviction history (recency/frequency) of a resized cache starts over, pinned pages stay pinned
+	// throws (without changing anything) if a shard can not have the new size or its pinned pages would not fit
+	void resizeCache(const int newActivePagesPerChannel)
+	{
+		if(numDevice * newActivePagesPerChannel > numPage)
+		{
+			throw std::invalid_argument(std::string("Error: total number of active pages (")+std::to_string(numDevice * newActivePagesPerChannel)+
+					std::string(") required to be less than or equal to total pages(")+std::to_string(numPage)+std::string(")"));
+		}
+
+		for(size_t i=0;i<numDevice;i++)
+		{
+			auto lock = lockAllShards(i);
+			va.get()[i].checkCacheSize(newActivePagesPerChannel);
+		}
+
+		std::vector<std::thread> parallel;
+		for(size_t i=0;i<numDevice;i++)
+		{
+			parallel.push_back(std::thread([&,i]()
+			{
+				VirtualArray<T> & vai = va.get()[i];
+				for(size_t shard=0;shard<numShard;shard++)
+				{
+					LMutex & shardLock = pageLock.get()[i*numShard + shard];
+					const int numActiveShard = vai.shardSizeOf(newActivePagesPerChannel,shard);
+					int currentSize = 0;
+					{
+						LExclusiveLock lock(shardLock);
+						currentSize = vai.getShardSize(shard);
+					}
+
+					if(numActiveShard>currentSize)
+					{
+						std::shared_ptr<Page<T>> pages = vai.allocatePages(numActiveShard-currentSize);
+						LExclusiveLock lock(shardLock);
+						vai.growShard(shard,pages,numActiveShard-currentSize);
+					}
+					else if(numActiveShard<currentSize)
+					{
+						std::vector<Page<T>> retired;
+						bool work = true;
+						while(work)
+						{
+							LExclusiveLock lock(shardLock);
+							work = vai.shrinkShardOne(shard,numActiveShard,retired);
+						}
+
+						{
+							LExclusiveLock lock(shardLock);
+							vai.compactShard(shard);
+						}
+
+						// thread-local page caches and iterators may still be reading removed buffers
+						waitForLockFreeReaders();
+					}
 				}
+			}));
+		}
+
+		for(size_t i=0;i<numDevice;i++)
+		{
+			if(parallel[i].joinable())
+			{
+				parallel[i].join();
+			}
+		}
+	}
+
+	// writes all edited active pages to vram
+	// resets all active pages
+	// use this before a series of uncached reads/writes
+	void streamStart()
+	{
+		std::vector<std::thread> parallel;
+		for(int i=0;i<numDevice;i++)
+		{
+			parallel.push_back(std::thread([&,i]()
+			{
+				auto lock = lockAllShards(i);
+				va.get()[i].flushAllPages();
+			}));
+		}
+		for(int i=0;i<numDevice;i++)
+		{
+			if(parallel[i].joinable())
+			{
+				parallel[i].join();
+			}
+		}
+	}
+
+	// reloads all edited frozen pages from vram to active pages (LRU cache)
+	// resets all active pages
+	// overwrites any cached writes happened before
+	// use this after a series of uncached reads/writes
+	void streamStop()
+	{
+		std::vector<std::thread> parallel;
+		for(int i=0;i<numDevice;i++)
+		{
+			parallel.push_back(std::thread([&,i]()
+			{
+				auto lock = lockAllShards(i);
+				va.get()[i].reloadAllPages();
+			}));
+		}
+		for(int i=0;i<numDevice;i++)
+		{
+			if(parallel[i].joinable())
+			{
+				parallel[i].join();
+			}
+		}
+	}
+
+
+
+	// using gpu compute power, finds an element with given member value, returns its index
+	// obj: object instance
+	// member: member of object to be used for searching value
+	// indexListMaxSize: maximum number of indices found
+	template<typename S>
+	std::vector<size_t> find(T & obj, S & member, const int indexListMaxSize=1)
+	{
+		//throw std::invalid_argument("Error: find method not implemented.");
+		size_t adrObj = (size_t) &obj;
+		size_t adrMem = (size_t) &member;
+		size_t offset = adrMem - adrObj; // how many bytes the member is found after
+		std::vector<size_t> results;
+
+		// 1) flush all active pages, expect user not to touch any element during search
+		// 2) run search on all gpus on all of their data
+		// 3) return index
+
+		std::vector<std::thread> parallel;
+
+
+		std::mutex mGlobal;
+		for(int i=0;i<numDevice;i++)
+		{
+			parallel.push_back(std::thread([&,i]()
+			{
+				auto lock = lockAllShards(i);
+				va.get()[i].flushAllPages();
 
 				std::vector<size_t> resultI = va.get()[i].find(offset,member,i,indexListMaxSize);
 
@@ -727,35 +1456,1371 @@ public:
 		return results;
 	}
 
-	class SetterGetter
+	// using gpu compute power, finds all elements that satisfy predicate (see Predicate.h), returns their indices in ascending order
+	// all virtual gpus search their vram at the same time (edited cached pages are uploaded first)
+	// number of results is not limited: matches are counted first, then result buffers are allocated and filled
+	// expects user not to write any element during search (same as find)
+	std::vector<size_t> findIf(const Predicate & predicate) const
 	{
-	public:
-		SetterGetter():ptr(nullptr),idx(0){}
+		if(predicate.memberEnd()>sizeof(T))
+		{
+			throw std::invalid_argument(std::string("error: predicate reads ")+std::to_string(predicate.memberEnd())+
+					std::string(" bytes of an element of ")+std::to_string(sizeof(T))+std::string(" bytes"));
+		}
 
-		SetterGetter(size_t i, VirtualMultiArray<T> * p):idx(i),ptr(p){}
+		std::string condition;
+		std::vector<unsigned char> operand;
+		predicate.build(condition,operand);
 
-		void operator = (T val)  { ptr->set(idx,val); }
-		operator T(){ return ptr->get(idx); }
+		std::vector<std::vector<size_t>> found(numDevice);
+		forEachVirtualGpuParallel([&](const size_t selectedVirtualArray)
+		{
+			// pages of virtual gpu that are in array
+			const size_t numPageOfVirtualArray = (numPage - selectedVirtualArray + numDevice - 1)/numDevice;
+			{
+				auto lock = lockAllShards(selectedVirtualArray);
+				va.get()[selectedVirtualArray].flushAllPages();
+				found[selectedVirtualArray] = va.get()[selectedVirtualArray].findIf(condition,operand,predicate.usesDouble(),numPageOfVirtualArray*pageSize);
+			}
 
-		void operator = (SetterGetter sg){ ptr->set(idx,sg.ptr->get(sg.idx));  }
-	private:
-		size_t  idx;
-		VirtualMultiArray<T> * ptr;
+			for(size_t & e:found[selectedVirtualArray])
+			{
+				e = ((e/pageSize)*numDevice + selectedVirtualArray)*pageSize + e%pageSize;
+			}
+		});
 
-	};
+		// every list is ascending
+		std::vector<size_t> result;
+		for(const auto & f:found)
+		{
+			const size_t mid = result.size();
+			result.insert(result.end(),f.begin(),f.end());
+			std::inplace_merge(result.begin(),result.begin()+mid,result.end());
+		}
+		return result;
+	}
+
+	// using gpu compute power, reduces member of all elements to one value: ReduceOp::Sum, Min, Max, Count or Mean
+	// member: PredicateField of member (int32_t, int64_t, float or double, see Predicate.h)
+	// all virtual gpus reduce their vram at the same time with work-group tree reductions, only partial results
+	// (at most REDUCE_MAX_GROUPS per virtual gpu) cross pcie and they are combined on host
+	// integer members are summed in 64 bits, float members in float on gpu (double on host), double members in double
+	// Min, Max, Mean of no element is NaN
+	// edited cached pages are uploaded first, expects user not to write any element during reduction (same as find)
+	template<typename S>
+	double reduce(const PredicateField<S> & member, const ReduceOp op) const
+	{
+		return reduceWhere(member,op,std::string("1"),std::vector<unsigned char>(),false);
+	}
+
+	// same as above, only for elements that satisfy where (for example, ReduceOp::Count of where gives number of matches without their indices)
+	template<typename S>
+	double reduce(const PredicateField<S> & member, const ReduceOp op, const Predicate & where) const
+	{
+		if(where.memberEnd()>sizeof(T))
+		{
+			throw std::invalid_argument(std::string("error: predicate reads ")+std::to_string(where.memberEnd())+
+					std::string(" bytes of an element of ")+std::to_string(sizeof(T))+std::string(" bytes"));
+		}
+
+		std::string condition;
+		std::vector<unsigned char> operand;
+		where.build(condition,operand);
+		return reduceWhere(member,op,condition,operand,where.usesDouble());
+	}
+
+	class SetterGetter
+	{
+	public:
+		SetterGetter():ptr(nullptr),idx(0){}
+
+		SetterGetter(size_t i, VirtualMultiArray<T> * p):idx(i),ptr(p){}
+
+		void operator = (T val)  { ptr->set(idx,val); }
+		operator T(){ return ptr->get(idx); }
+
+		void operator = (SetterGetter sg){ ptr->set(idx,sg.ptr->get(sg.idx));  }
+	private:
+		size_t  idx;
+		VirtualMultiArray<T> * ptr;
+
+	};
 
 	SetterGetter operator [](const size_t id) { return SetterGetter(id,this); }
 	T operator [](const size_t id) const { return get(id); }
 
+private:
+	// pointer to a cached page, valid while lock of page keeps same version (no exclusive owner came in between)
+	struct PageView
+	{
+		// index of first element of page
+		size_t begin;
+
+		Page<T> * page;
+
+		// buffer of page
+		T * data;
+
+		LMutex * lock;
+
+		// version of lock when page pointer was taken
+		size_t version;
+	};
+public:
+
+	// element of a mutable iterator: reads/writes go through page views of calling thread (entries of thread-local page cache)
+	// it does not refer to its iterator, so it can outlive it (auto r = *it; r = x;) and it can be used by any thread
+	class ElementReference
+	{
+	public:
+		ElementReference(const VirtualMultiArray<T> * a, const size_t i):arr(a),idx(i){}
+		ElementReference(const ElementReference &) = default;
+
+		operator T() const { return arr->readThroughThreadView(idx); }
+
+		const ElementReference & operator = (const T & val) const
+		{
+			arr->writeThroughThreadView(idx,val);
+			return *this;
+		}
+
+		const ElementReference & operator = (const ElementReference & er) const
+		{
+			return *this = (T)er;
+		}
+
+		friend void swap(const ElementReference & a, const ElementReference & b)
+		{
+			const T tmp = a;
+			a = (T)b;
+			b = tmp;
+		}
+	private:
+		const VirtualMultiArray<T> * arr;
+		size_t idx;
+	};
+
+	// random-access iterator for STL algorithms and std::ranges
+	// const iterator keeps a view of the page of its last accessed element: elements of same page are read without lock or page lookup,
+	// cache is accessed only when iterator crosses a page boundary or when the page was evicted/edited by another thread in the meantime
+	// mutable iterator does the same (writes under page lock without lookup) through the page views of calling thread
+	// thread-safety is same as get()/set(), element accesses inside a page are not seen by eviction policy
+	// resizeCache() can run during iteration: buffer of a view is not freed while the iterator reads through it,
+	//		and a view of a page that was removed by shrinking is outdated so next access looks the page up again
+	// Mutable: dereferencing returns ElementReference (a proxy), so element type of callbacks should be auto or T, not T&
+	template<bool Mutable>
+	class Iterator
+	{
+	public:
+		using iterator_category = std::random_access_iterator_tag;
+#if __cplusplus >= 202002L
+		using iterator_concept = std::random_access_iterator_tag;
+#endif
+		using value_type = T;
+		using difference_type = std::ptrdiff_t;
+		using pointer = void;
+		using reference = typename std::conditional<Mutable,ElementReference,T>::type;
+
+		Iterator():arr(nullptr),idx(0),view{}{}
+		Iterator(const VirtualMultiArray<T> * a, const size_t i):arr(a),idx(i),view{}{}
+
+		// mutable to const conversion
+		template<bool M=Mutable, typename = typename std::enable_if<!M>::type>
+		Iterator(const Iterator<true> & it):arr(it.arr),idx(it.idx),view(it.view){}
+
+		reference operator * () const { return element(idx); }
+		reference operator [] (const difference_type n) const { return element(idx + n); }
+
+		Iterator & operator ++ () { idx++; return *this; }
+		Iterator & operator -- () { idx--; return *this; }
+		Iterator operator ++ (int) { Iterator it = *this; idx++; return it; }
+		Iterator operator -- (int) { Iterator it = *this; idx--; return it; }
+		Iterator & operator += (const difference_type n) { idx += n; return *this; }
+		Iterator & operator -= (const difference_type n) { idx -= n; return *this; }
+		Iterator operator + (const difference_type n) const { Iterator it = *this; it.idx += n; return it; }
+		Iterator operator - (const difference_type n) const { Iterator it = *this; it.idx -= n; return it; }
+		friend Iterator operator + (const difference_type n, const Iterator & it) { return it + n; }
+		difference_type operator - (const Iterator & it) const { return (difference_type)idx - (difference_type)it.idx; }
+
+		bool operator == (const Iterator & it) const { return idx == it.idx; }
+		bool operator != (const Iterator & it) const { return idx != it.idx; }
+		bool operator < (const Iterator & it) const { return idx < it.idx; }
+		bool operator > (const Iterator & it) const { return idx > it.idx; }
+		bool operator <= (const Iterator & it) const { return idx <= it.idx; }
+		bool operator >= (const Iterator & it) const { return idx >= it.idx; }
+
+		// element index
+		size_t index() const noexcept { return idx; }
+	private:
+		template<bool> friend class Iterator;
+
+		const VirtualMultiArray<T> * arr;
+		size_t idx;
+
+		// page of last accessed element (const iterator)
+		mutable PageView view;
+
+		reference element(const size_t i) const
+		{
+			if constexpr (Mutable)
+			{
+				return ElementReference(arr,i);
+			}
+			else
+			{
+				return arr->readThroughView(view,i);
+			}
+		}
+	};
+
+	using iterator = Iterator<true>;
+	using const_iterator = Iterator<false>;
+
+	iterator begin() { return iterator(this,0); }
+	iterator end() { return iterator(this,size()); }
+	const_iterator begin() const { return const_iterator(this,0); }
+	const_iterator end() const { return const_iterator(this,size()); }
+	const_iterator cbegin() const { return const_iterator(this,0); }
+	const_iterator cend() const { return const_iterator(this,size()); }
+
+	// number of elements
+	size_t size() const noexcept { return numPage*pageSize; }
+
 
 	~VirtualMultiArray(){}
 private:
 	size_t numDevice;
 	size_t pageSize;
+	size_t numShard;
+	size_t numPage;
+	bool useThreadLocalPageCache;
+	int maxAutoPrefetchDistance;
+	size_t arrayId;
 	std::shared_ptr<VirtualArray<T>> va;
 	std::shared_ptr<LMutex> pageLock;
 	std::vector<int> openclChannels;
-	std::shared_ptr<Prefetcher<VirtualMultiArray<T>>> funcRun;
+	std::shared_ptr<Prefetcher> funcRun;
+
+	// a page that was accessed recently by a thread
+	struct ThreadLocalPageEntry
+	{
+		// owner array, 0 = empty
+		size_t arrayId;
+
+		PageView view;
+	};
+
+	struct ThreadLocalPageCache
+	{
+		ThreadLocalPageEntry entry[THREAD_LOCAL_PAGE_CACHE_SIZE];
+		int victim;
+	};
+
+	// shared by all arrays of same element type
+	static ThreadLocalPageCache & threadLocalPageCache()
+	{
+		static thread_local ThreadLocalPageCache cache{};
+		return cache;
+	}
+
+	// a thread that reads pages through views without lock, counter is odd while it reads
+	// resizeCache() frees buffers of removed slots only after every reader that may have seen them has left
+	struct alignas(64) LockFreeReader
+	{
+		std::atomic<size_t> counter{0};
+		bool used{false};
+
+		// freeing thread uses processBarrier(), so reads need only a compiler barrier
+		bool asymmetric{false};
+
+		void enter() noexcept
+		{
+			counter.store(counter.load(std::memory_order_relaxed)+1,std::memory_order_relaxed);
+
+			// version of page lock is loaded after freeing thread can see the counter
+			// with a process-wide barrier on freeing side, compiler barrier is enough here
+			if(asymmetric)
+			{
+				std::atomic_signal_fence(std::memory_order_seq_cst);
+			}
+			else
+			{
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+			}
+		}
+
+		void leave() noexcept
+		{
+			counter.store(counter.load(std::memory_order_relaxed)+1,std::memory_order_release);
+		}
+	};
+
+	// readers of all threads, a reader is reused by a new thread after its thread exits
+	struct LockFreeReaderList
+	{
+		std::mutex m;
+		std::vector<std::unique_ptr<LockFreeReader>> reader;
+	};
+
+	static LockFreeReaderList & lockFreeReaderList()
+	{
+		static LockFreeReaderList list;
+		return list;
+	}
+
+	struct LockFreeReaderHandle
+	{
+		LockFreeReader * reader;
+
+		LockFreeReaderHandle():reader(nullptr)
+		{
+			LockFreeReaderList & list = lockFreeReaderList();
+			std::unique_lock<std::mutex> lck(list.m);
+			for(auto & r:list.reader)
+			{
+				if(!r->used)
+				{
+					reader = r.get();
+					break;
+				}
+			}
+			if(reader==nullptr)
+			{
+				list.reader.push_back(std::unique_ptr<LockFreeReader>(new LockFreeReader()));
+				reader = list.reader.back().get();
+			}
+			reader->used = true;
+			reader->asymmetric = processBarrierSupported();
+		}
+
+		~LockFreeReaderHandle()
+		{
+			LockFreeReaderList & list = lockFreeReaderList();
+			std::unique_lock<std::mutex> lck(list.m);
+			reader->used = false;
+		}
+	};
+
+	// reader of calling thread
+	static LockFreeReader & lockFreeReader()
+	{
+		static thread_local LockFreeReaderHandle handle;
+		return *handle.reader;
+	}
+
+	// true if processBarrier() can make all threads of process execute a memory barrier
+	static bool processBarrierSupported()
+	{
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
+		// windows
+		return true;
+#else
+		// linux
+#ifdef __NR_membarrier
+		static const bool registered = (syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0)==0);
+		return registered;
+#else
+		return false;
+#endif
+#endif
+	}
+
+	// full memory barrier on every running thread of process (so lock-free readers do not need one per read)
+	static void processBarrier()
+	{
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
+		// windows
+		FlushProcessWriteBuffers();
+#else
+		// linux
+#ifdef __NR_membarrier
+		if(syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0)!=0)
+		{
+			throw std::invalid_argument("error: membarrier");
+		}
+#endif
+#endif
+	}
+
+	// returns after all lock-free reads that started before the page locks of freed buffers were taken are complete
+	// (later reads see a changed version and do not touch page buffer)
+	static void waitForLockFreeReaders()
+	{
+		if(processBarrierSupported())
+		{
+			processBarrier();
+		}
+		else
+		{
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+		}
+		LockFreeReaderList & list = lockFreeReaderList();
+		std::unique_lock<std::mutex> lck(list.m);
+		for(auto & r:list.reader)
+		{
+			const size_t counter = r->counter.load(std::memory_order_acquire);
+			if(counter&1)
+			{
+				while(r->counter.load(std::memory_order_acquire)==counter)
+				{
+					std::this_thread::yield();
+				}
+			}
+		}
+	}
+
+	static size_t generateArrayId()
+	{
+		static std::atomic<size_t> ctr{0};
+		return ++ctr;
+	}
+
+	ThreadLocalPageEntry * findThreadLocalPage(const size_t & index) const
+	{
+		ThreadLocalPageCache & cache = threadLocalPageCache();
+		for(int i=0;i<THREAD_LOCAL_PAGE_CACHE_SIZE;i++)
+		{
+			ThreadLocalPageEntry & entry = cache.entry[i];
+			if((entry.arrayId==arrayId) && (index - entry.view.begin < pageSize))
+			{
+				return &entry;
+			}
+		}
+		return nullptr;
+	}
+
+	void storeThreadLocalPage(const PageView & view) const
+	{
+		ThreadLocalPageCache & cache = threadLocalPageCache();
+		ThreadLocalPageEntry * entry = findThreadLocalPage(view.begin);
+		if(entry==nullptr)
+		{
+			entry = cache.entry + cache.victim;
+			cache.victim = (cache.victim+1)%THREAD_LOCAL_PAGE_CACHE_SIZE;
+		}
+		entry->arrayId = arrayId;
+		entry->view = view;
+	}
+
+	// reads element through view without lock or page lookup
+	// false if view does not cover index or its page was evicted/edited by another exclusive owner after view was taken
+	bool readView(const PageView & view, const size_t & index, T & result) const
+	{
+		if((view.lock==nullptr) || (index - view.begin >= pageSize))
+		{
+			return false;
+		}
+
+		// buffer of view is not freed by resizeCache() while this thread is inside
+		LockFreeReader & reader = lockFreeReader();
+		reader.enter();
+		bool valid = false;
+		const size_t version = view.lock->version.load(std::memory_order_acquire);
+		if(version==view.version)
+		{
+			result = view.data[index - view.begin];
+
+			// element is valid only if no exclusive owner started in the meantime
+			std::atomic_thread_fence(std::memory_order_acquire);
+			valid = (view.lock->version.load(std::memory_order_relaxed)==version);
+		}
+		reader.leave();
+		return valid;
+	}
+
+	// writes element through view under exclusive lock of its page, without page lookup
+	// false (nothing written) if view does not cover index or is outdated
+	bool writeView(PageView & view, const size_t & index, const T & val) const
+	{
+		if((view.lock==nullptr) || (index - view.begin >= pageSize))
+		{
+			return false;
+		}
+
+		// page is still in same slot if no other exclusive owner came in between
+		LExclusiveLock lock(*view.lock);
+		if(view.version+2 != lock.versionAfterUnlock())
+		{
+			return false;
+		}
+		const int pageElement = index - view.begin;
+		view.page->edit(pageElement, val);
+		view.page->markAsEdited(pageElement);
+		view.version = lock.versionAfterUnlock();
+		return true;
+	}
+
+	// reads element through view, view is moved to page of element when it does not cover it
+	T readThroughView(PageView & view, const size_t & index) const
+	{
+		T result;
+		if(readView(view,index,result))
+		{
+			return result;
+		}
+		return readAndMoveView(view,index);
+	}
+
+	// reads element from cache and points view to its page
+	T readAndMoveView(PageView & view, const size_t & index) const
+	{
+		const size_t selectedPage = index/pageSize;
+		const size_t selectedVirtualArray = selectedPage%numDevice;
+		const size_t pageBegin = (selectedPage/numDevice)*pageSize;
+		const size_t pageElement = index%pageSize;
+		if(maxAutoPrefetchDistance>0)
+		{
+			autoPrefetch(selectedPage);
+		}
+
+		LMutex & lm = lockOfPage(selectedPage);
+		{
+			std::shared_lock<std::shared_mutex> lock(lm.m);
+			Page<T> * const page = va.get()[selectedVirtualArray].getPageShared(pageBegin);
+			if(page!=nullptr)
+			{
+				view = PageView{index - pageElement, page, page->ptr(), &lm, lm.version.load(std::memory_order_relaxed)};
+				return page->ptr()[pageElement];
+			}
+		}
+
+		LExclusiveLock lock(lm);
+		Page<T> * const page = va.get()[selectedVirtualArray].getPage(pageBegin);
+		view = PageView{index - pageElement, page, page->ptr(), &lm, lock.versionAfterUnlock()};
+		return page->ptr()[pageElement];
+	}
+
+	// reads element through page view of calling thread (used even when thread-local page cache is disabled for get)
+	T readThroughThreadView(const size_t & index) const
+	{
+		ThreadLocalPageEntry * const entry = findThreadLocalPage(index);
+		T result;
+		if((entry!=nullptr) && readView(entry->view,index,result))
+		{
+			return result;
+		}
+
+		PageView view{};
+		result = readAndMoveView(view,index);
+		storeThreadLocalPage(view);
+		return result;
+	}
+
+	// writes element through page view of calling thread (used even when thread-local page cache is disabled for set)
+	void writeThroughThreadView(const size_t & index, const T & val) const
+	{
+		ThreadLocalPageEntry * const entry = findThreadLocalPage(index);
+		if((entry!=nullptr) && writeView(entry->view,index,val))
+		{
+			return;
+		}
+
+		PageView view{};
+		writeAndMoveView(view,index,val);
+		storeThreadLocalPage(view);
+	}
+
+	// writes element into cache and points view to its page
+	void writeAndMoveView(PageView & view, const size_t & index, const T & val) const
+	{
+		const size_t selectedPage = index/pageSize;
+		const size_t pageElement = index%pageSize;
+		if(maxAutoPrefetchDistance>0)
+		{
+			autoPrefetch(selectedPage);
+		}
+
+		LMutex & lm = lockOfPage(selectedPage);
+		LExclusiveLock lock(lm);
+		Page<T> * const page = va.get()[selectedPage%numDevice].getPage((selectedPage/numDevice)*pageSize);
+		page->edit(pageElement, val);
+		page->markAsEdited(pageElement);
+		view = PageView{index - pageElement, page, page->ptr(), &lm, lock.versionAfterUnlock()};
+	}
+
+	// page-level access history of a thread on an array
+	struct AccessPatternEntry
+	{
+		// owner array, 0 = empty
+		size_t arrayId;
+
+		long long lastPage;
+
+		// last page change (in pages), 0 = no history yet
+		long long stride;
+
+		// number of consecutive page changes with same stride
+		int repeat;
+
+		// first page in stride direction that is not queued for prefetching yet
+		long long nextPrefetchPage;
+
+		std::chrono::steady_clock::time_point lastPageChange;
+
+		// moving average of time between page changes, in nanoseconds
+		double pageIntervalNs;
+	};
+
+	struct AccessPatternTable
+	{
+		AccessPatternEntry entry[THREAD_LOCAL_ACCESS_PATTERN_SIZE];
+		int victim;
+	};
+
+	static AccessPatternTable & threadLocalAccessPattern()
+	{
+		static thread_local AccessPatternTable table{};
+		return table;
+	}
+
+	// tracks page changes of calling thread, queues next pages to prefetcher when they follow a constant stride
+	void autoPrefetch(const size_t & selectedPage) const
+	{
+		if(!funcRun)
+		{
+			return;
+		}
+
+		AccessPatternTable & table = threadLocalAccessPattern();
+		AccessPatternEntry * entry = nullptr;
+		for(int i=0;i<THREAD_LOCAL_ACCESS_PATTERN_SIZE;i++)
+		{
+			if(table.entry[i].arrayId == arrayId)
+			{
+				entry = table.entry + i;
+				break;
+			}
+		}
+
+		const long long page = selectedPage;
+		const auto now = std::chrono::steady_clock::now();
+		if(entry==nullptr)
+		{
+			entry = table.entry + table.victim;
+			table.victim = (table.victim+1)%THREAD_LOCAL_ACCESS_PATTERN_SIZE;
+			*entry = AccessPatternEntry{arrayId,page,0,0,page,now,0.0};
+			return;
+		}
+
+		if(entry->lastPage == page)
+		{
+			return;
+		}
+
+		const long long stride = page - entry->lastPage;
+		const double interval = std::chrono::duration<double,std::nano>(now - entry->lastPageChange).count();
+		entry->lastPage = page;
+		entry->lastPageChange = now;
+		if(stride != entry->stride)
+		{
+			entry->stride = stride;
+			entry->repeat = 0;
+			entry->nextPrefetchPage = page + stride;
+			entry->pageIntervalNs = interval;
+			return;
+		}
+
+		entry->pageIntervalNs = (entry->pageIntervalNs*3.0 + interval)*0.25;
+		if(++entry->repeat < AUTO_PREFETCH_MIN_REPEAT)
+		{
+			return;
+		}
+
+		// enough pages ahead to cover one page load at current access speed (1 until prefetcher measured a load)
+		int distance = 1;
+		const long long latency = funcRun->averageLatencyNanoseconds();
+		if(latency > 0)
+		{
+			const double pagesPerLoad = latency / std::max(entry->pageIntervalNs,1.0);
+			distance = (int)std::min(pagesPerLoad + 1.0,(double)maxAutoPrefetchDistance);
+		}
+
+		// thread may have run past the queued pages
+		if((stride>0)?(entry->nextPrefetchPage <= page):(entry->nextPrefetchPage >= page))
+		{
+			entry->nextPrefetchPage = page + stride;
+		}
+
+		const long long lastPrefetchPage = page + stride*distance;
+		const long long numPageL = numPage;
+		long long p = entry->nextPrefetchPage;
+		for(; (stride>0)?(p <= lastPrefetchPage):(p >= lastPrefetchPage); p += stride)
+		{
+			if(p<0 || p>=numPageL)
+			{
+				break;
+			}
+			funcRun->push(p);
+		}
+		entry->nextPrefetchPage = p;
+	}
+
+	// sorts positions of idx by (virtual gpu, page, position) and calls f(page, group, count) once per distinct page
+	// group: count elements of {sort key, position in idx}, page is locked (exclusively when write==true) during f
+	// virtual gpus run as tasks of the shared thread pool for large n, first exception is rethrown
+	template<typename F>
+	void forEachPageGroup(const size_t * const idx, const size_t n, const bool write, F f) const
+	{
+		if(n==0)
+		{
+			return;
+		}
+
+		// key = virtual gpu * (pages per virtual gpu) + page of virtual gpu
+		const size_t numInterleaveMax = numPage/numDevice + 1;
+		std::vector<std::pair<size_t,size_t>> sorted(n);
+		for(size_t i=0;i<n;i++)
+		{
+			const size_t selectedPage = idx[i]/pageSize;
+			sorted[i] = std::pair<size_t,size_t>((selectedPage%numDevice)*numInterleaveMax + selectedPage/numDevice, i);
+		}
+		std::sort(sorted.begin(),sorted.end());
+
+		auto serve = [&](const size_t begin, const size_t end)
+		{
+			size_t i = begin;
+			while(i<end)
+			{
+				size_t j = i+1;
+				while((j<end) && (sorted[j].first==sorted[i].first))
+				{
+					j++;
+				}
+
+				const size_t selectedVirtualArray = sorted[i].first/numInterleaveMax;
+				const size_t numInterleave = sorted[i].first%numInterleaveMax;
+				const size_t selectedPage = numInterleave*numDevice + selectedVirtualArray;
+				const size_t selectedElement = numInterleave*pageSize;
+				bool done = false;
+				if(!write)
+				{
+					std::shared_lock<std::shared_mutex> lock(lockOfPage(selectedPage).m);
+					Page<T> * const page = va.get()[selectedVirtualArray].getPageShared(selectedElement);
+					if(page!=nullptr)
+					{
+						f(page,sorted.data()+i,j-i);
+						done = true;
+					}
+				}
+
+				if(!done)
+				{
+					LExclusiveLock lock(lockOfPage(selectedPage));
+					f(va.get()[selectedVirtualArray].getPage(selectedElement),sorted.data()+i,j-i);
+				}
+				i = j;
+			}
+		};
+
+		if(n<GATHER_SCATTER_PARALLEL_MIN)
+		{
+			serve(0,n);
+			return;
+		}
+
+		// non-empty ranges of sorted elements of virtual gpus, a single range is served on calling thread
+		std::vector<std::pair<size_t,size_t>> ranges;
+		size_t begin = 0;
+		for(size_t v=0;v<numDevice;v++)
+		{
+			const size_t end = std::lower_bound(sorted.begin()+begin,sorted.end(),std::pair<size_t,size_t>((v+1)*numInterleaveMax,0)) - sorted.begin();
+			if(end>begin)
+			{
+				ranges.push_back(std::pair<size_t,size_t>(begin,end));
+			}
+			begin = end;
+		}
+
+		ThreadPool::shared().parallelFor(ranges.size(),[&](const size_t r)
+		{
+			serve(ranges[r].first,ranges[r].second);
+		});
+	}
+
+	// reduce() of elements that satisfy condition (OpenCL C code of a Predicate)
+	template<typename S>
+	double reduceWhere(const PredicateField<S> & member, const ReduceOp op, const std::string & condition,
+			const std::vector<unsigned char> & operand, const bool fp64) const
+	{
+		if(member.memberOffset()+sizeof(S)>sizeof(T))
+		{
+			throw std::invalid_argument(std::string("error: reduced member ends at byte ")+std::to_string(member.memberOffset()+sizeof(S))+
+					std::string(" of an element of ")+std::to_string(sizeof(T))+std::string(" bytes"));
+		}
+
+		// accumulator on gpu, sum on host
+		typedef typename std::conditional<std::is_integral<S>::value,int64_t,S>::type A;
+		typedef typename std::conditional<std::is_integral<S>::value,int64_t,double>::type H;
+
+		std::vector<ReducePartials<A>> partial(numDevice);
+		forEachVirtualGpuParallel([&](const size_t selectedVirtualArray)
+		{
+			// pages of virtual gpu that are in array
+			const size_t numPageOfVirtualArray = (numPage - selectedVirtualArray + numDevice - 1)/numDevice;
+			auto lock = lockAllShards(selectedVirtualArray);
+			va.get()[selectedVirtualArray].flushAllPages();
+			partial[selectedVirtualArray] = va.get()[selectedVirtualArray].template reduce<A>(member.memberOffset(),PredicateType<S>::name,PredicateType<A>::name,
+					condition,operand,fp64 || std::is_same<S,double>::value,numPageOfVirtualArray*pageSize);
+		});
+
+		H sum = 0;
+		A minimum = 0;
+		A maximum = 0;
+		size_t count = 0;
+		for(const auto & p:partial)
+		{
+			for(size_t i=0;i<p.count.size();i++)
+			{
+				if(p.count[i]>0)
+				{
+					sum += (H)p.sum[i];
+					minimum = ((count==0) || (p.min[i]<minimum))?p.min[i]:minimum;
+					maximum = ((count==0) || (p.max[i]>maximum))?p.max[i]:maximum;
+					count += p.count[i];
+				}
+			}
+		}
+
+		switch(op)
+		{
+			case ReduceOp::Sum: return (double)sum;
+			case ReduceOp::Count: return (double)count;
+			case ReduceOp::Min: return (count==0)?std::numeric_limits<double>::quiet_NaN():(double)minimum;
+			case ReduceOp::Max: return (count==0)?std::numeric_limits<double>::quiet_NaN():(double)maximum;
+			default: return (count==0)?std::numeric_limits<double>::quiet_NaN():((double)sum)/count;
+		}
+	}
+
+	// number of elements in a snapshot file, checks its header
+	static size_t numSnapshotElements(const std::string & path)
+	{
+		std::ifstream file(path,std::ios::binary|std::ios::ate);
+		if(!file)
+		{
+			throw std::invalid_argument(std::string("error: cannot open file ")+path);
+		}
+		const size_t fileBytes = (size_t)file.tellg();
+		file.seekg(0);
+
+		char header[SNAPSHOT_HEADER_BYTES]={0};
+		uint64_t elementBytes = 0;
+		uint64_t numElements = 0;
+		if(!file.read(header,SNAPSHOT_HEADER_BYTES) || (std::memcmp(header,"VMASNAP1",8)!=0))
+		{
+			throw std::invalid_argument(std::string("error: ")+path+std::string(" is not a snapshot file"));
+		}
+		std::memcpy(&elementBytes,header+8,8);
+		std::memcpy(&numElements,header+16,8);
+
+		if(elementBytes!=sizeof(T))
+		{
+			throw std::invalid_argument(std::string("error: snapshot file ")+path+std::string(" has elements of ")+std::to_string(elementBytes)+
+					std::string(" bytes, array elements have ")+std::to_string(sizeof(T))+std::string(" bytes"));
+		}
+
+		if(fileBytes < SNAPSHOT_HEADER_BYTES + numElements*sizeof(T))
+		{
+			throw std::invalid_argument(std::string("error: snapshot file ")+path+std::string(" is truncated"));
+		}
+		return numElements;
+	}
+
+	// background part of snapshot(): chunks are read from vram (and copy-on-write copies) into one staging buffer while the other is written to file
+	// copy-on-write of all virtual gpus ends when it returns (or throws)
+	void writeSnapshot(std::ofstream & file, const std::string & path) const
+	{
+		struct SnapshotEnd
+		{
+			const VirtualMultiArray<T> & arr;
+			~SnapshotEnd()
+			{
+				for(size_t i=0;i<arr.numDevice;i++)
+				{
+					auto lock = arr.lockAllShards(i);
+					arr.va.get()[i].endSnapshot();
+				}
+			}
+		} snapshotEnd{*this};
+
+		const size_t n = size();
+		const size_t chunk = fileStreamChunk();
+		StagingBuffer buf[2]={StagingBuffer(chunk),StagingBuffer(chunk)};
+		auto writeChunk = [&](const size_t k)
+		{
+			const size_t num = std::min(chunk,n-k*chunk);
+			if(!file.write((const char *)buf[k%2].get(),num*sizeof(T)))
+			{
+				throw std::invalid_argument(std::string("error: writing file ")+path+std::string(" failed"));
+			}
+		};
+
+		const size_t numChunk = (n+chunk-1)/chunk;
+		std::future<void> writing;
+		for(size_t k=0;k<numChunk;k++)
+		{
+			const size_t index = k*chunk;
+			const size_t num = std::min(chunk,n-index);
+			forEachVirtualGpuParallel([&](const size_t selectedVirtualArray){ snapshotDirect(selectedVirtualArray,index,num,buf[k%2].get()); });
+
+			if(writing.valid())
+			{
+				writing.get();
+			}
+			writing = std::async(std::launch::async,writeChunk,k);
+		}
+
+		if(writing.valid())
+		{
+			writing.get();
+		}
+
+		if(!file.flush())
+		{
+			throw std::invalid_argument(std::string("error: writing file ")+path+std::string(" failed"));
+		}
+	}
+
+	// reads the pages of a virtual gpu in [index,index+range) (whole pages) for a snapshot into buf (buf[0] holds element at index)
+	// cached pages are not flushed: vram (with copy-on-write copies) holds the elements as they were when snapshot started
+	void snapshotDirect(const size_t selectedVirtualArray, const size_t index, const size_t range, T * const buf) const
+	{
+		size_t p0 = 0;
+		size_t pN = 0;
+		if(!pagesOfVirtualGpu(selectedVirtualArray,index,range,p0,pN))
+		{
+			return;
+		}
+		VirtualArray<T> & vai = va.get()[selectedVirtualArray];
+		T * const host = buf + (p0*pageSize - index);
+
+		auto lock = lockAllShards(selectedVirtualArray);
+		cl_event evt = vai.enqueueDirect(false, (p0/numDevice)*pageSize, pageSize, (pN-p0)/numDevice + 1, host, numDevice*pageSize);
+		if(evt!=nullptr)
+		{
+			ClEventWaiter::waitAndRelease(evt,"error: snapshot read event");
+		}
+		vai.saveSnapshot(p0/numDevice,pN/numDevice,host,numDevice*pageSize);
+	}
+
+	// page-aligned host buffer of file streaming, page-locked when OS allows it (otherwise only slower transfers)
+	class StagingBuffer
+	{
+	public:
+		StagingBuffer(const size_t n):bytes(mappedBytes(n)),pinned(false)
+		{
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
+// windows
+			buf = (T *)_aligned_malloc(bytes,4096);
+#else
+// linux
+			buf = (T *)aligned_alloc(4096,bytes);
+#endif
+			if(buf==nullptr)
+			{
+				throw std::invalid_argument("error: staging buffer allocation failed");
+			}
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
+// windows
+			pinned = (0!=VirtualLock(buf,bytes));
+#else
+// linux
+			pinned = (0==mlock(buf,bytes));
+#endif
+		}
+
+		StagingBuffer(StagingBuffer && b):buf(b.buf),bytes(b.bytes),pinned(b.pinned)
+		{
+			b.buf = nullptr;
+		}
+
+		StagingBuffer(const StagingBuffer &) = delete;
+		StagingBuffer & operator = (const StagingBuffer &) = delete;
+
+		T * get() const noexcept { return buf; }
+
+		~StagingBuffer()
+		{
+			if(buf==nullptr)
+			{
+				return;
+			}
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
+// windows
+			if(pinned)
+			{
+				VirtualUnlock(buf,bytes);
+			}
+			_aligned_free(buf);
+#else
+// linux
+			if(pinned)
+			{
+				munlock(buf,bytes);
+			}
+			free(buf);
+#endif
+		}
+	private:
+		T * buf;
+		size_t bytes;
+		bool pinned;
+	};
+
+	// elements per chunk of loadFromFile/saveToFile: whole pages, same number of pages for every virtual gpu
+	size_t fileStreamChunk() const noexcept
+	{
+		const size_t pagesPerDevice = std::max((size_t)1,FILE_STREAM_CHUNK_BYTES/(sizeof(T)*pageSize*numDevice));
+		return std::min(size(),pagesPerDevice*numDevice*pageSize);
+	}
+
+	// bytes of a mapped buffer, rounded up to alignment
+	static size_t mappedBytes(const size_t range) noexcept
+	{
+		return std::max((size_t)4096,((sizeof(T)*range + 4095)/4096)*4096);
+	}
+
+	// runs f(virtual gpu index) for all virtual gpus as tasks of the shared thread pool (ThreadPool.h)
+	// after first exception, tasks that did not start are skipped and the exception is rethrown
+	template<typename F>
+	void forEachVirtualGpuParallel(F f) const
+	{
+		ThreadPool::shared().parallelFor(numDevice,[&](const size_t selectedVirtualArray)
+		{
+			f(selectedVirtualArray);
+		});
+	}
+
+	// runs f(block, index, buf, n) for consecutive blocks of whole pages on the shared thread pool
+	// buf is a private copy of elements [index,index+n), write=true writes back the pages that f changed
+	// a block has the same number of pages on every virtual gpu so that its prefetch keeps all of them busy
+	// blocks are sized so that current and next block of every pool thread fit in active pages together,
+	// when active pages are too few for that (minimum block is 1 page per virtual gpu), fewer tasks run at the same time
+	// every task is a run of consecutive blocks: next block is prefetched while current one is processed
+	template<typename F>
+	void forEachBlockParallel(const bool write, F f) const
+	{
+		if(numPage==0)
+		{
+			return;
+		}
+
+		ThreadPool & pool = ThreadPool::shared();
+		size_t totalActivePage = 0;
+		for(size_t i=0;i<numDevice;i++)
+		{
+			auto lock = lockAllShards(i);
+			totalActivePage += va.get()[i].getNumP();
+		}
+
+		const size_t blockPages = std::min(numPage,std::max((size_t)1,totalActivePage/(2*pool.size()*numDevice))*numDevice);
+		const size_t blockElements = blockPages*pageSize;
+		const size_t numBlock = (numPage + blockPages - 1)/blockPages;
+		const size_t blocksPerTask = std::min(PARALLEL_ALGORITHM_MAX_BLOCKS_PER_TASK,std::max((size_t)1,numBlock/(4*pool.size())));
+		const size_t numTask = (numBlock + blocksPerTask - 1)/blocksPerTask;
+		const size_t numRunner = std::min(numTask,std::max((size_t)1,totalActivePage/(2*blockPages)));
+		const size_t numElement = size();
+		std::atomic<size_t> nextTask(0);
+		auto runTask = [&](const size_t task)
+		{
+			const size_t blockBegin = task*blocksPerTask;
+			const size_t blockEnd = std::min(numBlock,blockBegin+blocksPerTask);
+			std::vector<T> buf(blockElements);
+			std::vector<T> original(write?blockElements:0);
+			std::future<void> loading = prefetchRange(blockBegin*blockElements,std::min(numElement,(blockBegin+1)*blockElements));
+			for(size_t block=blockBegin;block<blockEnd;block++)
+			{
+				const size_t index = block*blockElements;
+				const size_t n = std::min(blockElements,numElement-index);
+				loading.get();
+				if(block+1<blockEnd)
+				{
+					loading = prefetchRange(index+n,std::min(numElement,index+n+blockElements));
+				}
+
+				readInto(index,buf.data(),n);
+				if(write)
+				{
+					std::copy(buf.begin(),buf.begin()+n,original.begin());
+				}
+
+				f(block,index,buf.data(),n);
+
+				if(write)
+				{
+					for(size_t i=0;i<n;i+=pageSize)
+					{
+						const size_t m = std::min(pageSize,n-i);
+						if(std::memcmp(buf.data()+i,original.data()+i,m*sizeof(T))!=0)
+						{
+							writeFrom(index+i,buf.data()+i,m);
+						}
+					}
+				}
+			}
+		};
+
+		// every runner takes next task until none is left, so at most numRunner tasks hold blocks at the same time
+		pool.parallelFor(numRunner,[&](const size_t)
+		{
+			size_t task = 0;
+			while((task = nextTask.fetch_add(1))<numTask)
+			{
+				try
+				{
+					runTask(task);
+				}
+				catch(...)
+				{
+					// other runners stop at their next task
+					nextTask = numTask;
+					throw;
+				}
+			}
+		});
+	}
+
+	// first and last page (global index) of a virtual gpu that overlap [index,index+range), false if there is none
+	bool pagesOfVirtualGpu(const size_t selectedVirtualArray, const size_t index, const size_t range, size_t & p0, size_t & pN) const noexcept
+	{
+		if(range==0)
+		{
+			return false;
+		}
+
+		const size_t firstPage = index/pageSize;
+		const size_t lastPage = (index+range-1)/pageSize;
+		p0 = firstPage + (selectedVirtualArray + numDevice - firstPage%numDevice)%numDevice;
+		if(p0>lastPage)
+		{
+			return false;
+		}
+		pN = p0 + ((lastPage-p0)/numDevice)*numDevice;
+		return true;
+	}
+
+	// elements of a virtual gpu in [index,index+range) are contiguous in its vram (tail of first page, full pages, head of last page)
+	// so they are filled with one command, cached copies are filled in RAM
+	void fillDirect(const size_t selectedVirtualArray, const size_t index, const size_t range, const T & val) const
+	{
+		size_t p0 = 0;
+		size_t pN = 0;
+		if(!pagesOfVirtualGpu(selectedVirtualArray,index,range,p0,pN))
+		{
+			return;
+		}
+
+		VirtualArray<T> & vai = va.get()[selectedVirtualArray];
+		const size_t lo = std::max(index,p0*pageSize);
+		const size_t hi = std::min(index+range,(pN+1)*pageSize);
+		const size_t vramBegin = (p0/numDevice)*pageSize + (lo - p0*pageSize);
+		const size_t vramEnd = (pN/numDevice)*pageSize + (hi - pN*pageSize);
+		cl_event evt = nullptr;
+		{
+			auto lock = lockAllShards(selectedVirtualArray);
+			vai.prepareDirectWrite(p0/numDevice,pN/numDevice,[&](const size_t localPage, Page<T> * const page)
+			{
+				const size_t p = localPage*numDevice + selectedVirtualArray;
+				const size_t pageLo = std::max(index,p*pageSize);
+				const size_t pageHi = std::min(index+range,(p+1)*pageSize);
+				std::fill(page->ptr() + (pageLo - p*pageSize), page->ptr() + (pageHi - p*pageSize), val);
+			});
+			evt = vai.enqueueFill(vramBegin,vramEnd-vramBegin,val);
+		}
+
+		if(evt!=nullptr)
+		{
+			ClEventWaiter::waitAndRelease(evt,"error: fill event");
+		}
+	}
+
+	// part of a copy() that is written to one virtual gpu: n elements from vram element srcElement of source virtual gpu to vram element dstElement
+	struct CopySegment
+	{
+		size_t srcVirtualArray;
+		size_t srcElement;
+		size_t dstElement;
+		size_t n;
+	};
+
+	// writes the segments of a virtual gpu of copy() while its cache shards are locked
+	// edited cached pages of range are uploaded before (their edits outside of range are kept) and cached pages are downloaded again after
+	void copyDirect(const VirtualMultiArray<T> & src, const size_t selectedVirtualArray, const size_t index, const size_t range,
+			const std::vector<CopySegment> & segment) const
+	{
+		size_t p0 = 0;
+		size_t pN = 0;
+		if(!pagesOfVirtualGpu(selectedVirtualArray,index,range,p0,pN))
+		{
+			return;
+		}
+
+		VirtualArray<T> & vai = va.get()[selectedVirtualArray];
+		std::vector<T> bounce;
+		auto lock = lockAllShards(selectedVirtualArray);
+		vai.flushPages(p0/numDevice,pN/numDevice);
+		for(const CopySegment & seg:segment)
+		{
+			VirtualArray<T> & srcVa = src.va.get()[seg.srcVirtualArray];
+			if(vai.sharesContextWith(srcVa))
+			{
+				vai.enqueueCopyFrom(srcVa,seg.srcElement,seg.dstElement,seg.n);
+				continue;
+			}
+
+			const size_t bounceElements = std::max((size_t)1,COPY_BOUNCE_BYTES/sizeof(T));
+			bounce.resize(std::min(seg.n,bounceElements));
+			for(size_t i=0;i<seg.n;i+=bounceElements)
+			{
+				const size_t m = std::min(bounceElements,seg.n-i);
+				cl_event evt = srcVa.enqueueDirect(false,seg.srcElement+i,m,1,bounce.data(),0);
+				if(evt!=nullptr)
+				{
+					ClEventWaiter::waitAndRelease(evt,"error: copy read event");
+				}
+
+				evt = vai.enqueueDirect(true,seg.dstElement+i,m,1,bounce.data(),0);
+				if(evt!=nullptr)
+				{
+					ClEventWaiter::waitAndRelease(evt,"error: copy write event");
+				}
+			}
+		}
+
+		// same in-order queue: downloads come after copies and return after all are complete
+		vai.reloadPages(p0/numDevice,pN/numDevice);
+	}
+
+	// direct transfer of the pages of a virtual gpu that overlap [index,index+range), buf[0] holds element at index
+	// partial first/last pages are transferred alone, full pages in between with one rectangular transfer
+	// cache is made coherent and transfers are enqueued under locks of all shards of the virtual gpu, then waited without locks
+	// (later cache traffic of the virtual gpu is on same in-order queue so it comes after these transfers)
+	void mappedDirect(const size_t selectedVirtualArray, const size_t index, const size_t range, T * const buf, const bool write) const
+	{
+		size_t p0 = 0;
+		size_t pN = 0;
+		if(!pagesOfVirtualGpu(selectedVirtualArray,index,range,p0,pN))
+		{
+			return;
+		}
+		const size_t numPageOfVirtualArray = (pN-p0)/numDevice + 1;
+		VirtualArray<T> & vai = va.get()[selectedVirtualArray];
+
+		// part of page p that is in range
+		auto rangeOfPage = [&](const size_t p, size_t & lo, size_t & hi)
+		{
+			lo = std::max(index,p*pageSize);
+			hi = std::min(index+range,(p+1)*pageSize);
+		};
+
+		std::vector<cl_event> events;
+		try
+		{
+			auto lock = lockAllShards(selectedVirtualArray);
+			if(write)
+			{
+				vai.prepareDirectWrite(p0/numDevice,pN/numDevice,[&](const size_t localPage, Page<T> * const page)
+				{
+					const size_t p = localPage*numDevice + selectedVirtualArray;
+					size_t lo, hi;
+					rangeOfPage(p,lo,hi);
+					std::copy(buf + (lo-index), buf + (hi-index), page->ptr() + (lo - p*pageSize));
+				});
+			}
+			else
+			{
+				vai.flushPages(p0/numDevice,pN/numDevice);
+			}
+
+			auto partial = [&](const size_t p)
+			{
+				size_t lo, hi;
+				rangeOfPage(p,lo,hi);
+				events.push_back(vai.enqueueDirect(write, (p/numDevice)*pageSize + (lo - p*pageSize), hi-lo, 1, buf + (lo-index), 0));
+			};
+
+			size_t fullBegin = 0;
+			size_t fullEnd = numPageOfVirtualArray;
+			if(p0*pageSize < index)
+			{
+				partial(p0);
+				fullBegin = 1;
+			}
+
+			if(((pN+1)*pageSize > index+range) && (numPageOfVirtualArray-1 >= fullBegin))
+			{
+				partial(pN);
+				fullEnd = numPageOfVirtualArray-1;
+			}
+
+			if(fullEnd>fullBegin)
+			{
+				const size_t p = p0 + fullBegin*numDevice;
+				events.push_back(vai.enqueueDirect(write, (p/numDevice)*pageSize, pageSize, fullEnd-fullBegin, buf + (p*pageSize-index), numDevice*pageSize));
+			}
+		}
+		catch(...)
+		{
+			// enqueued transfers still use buf
+			for(cl_event & e:events)
+			{
+				if(e!=nullptr)
+				{
+					clWaitForEvents(1,&e);
+					clReleaseEvent(e);
+				}
+			}
+			throw;
+		}
+
+		for(size_t i=0;i<events.size();i++)
+		{
+			if(events[i]!=nullptr)
+			{
+				try
+				{
+					ClEventWaiter::waitAndRelease(events[i],write?"error: direct write event":"error: direct read event");
+				}
+				catch(...)
+				{
+					for(size_t k=i+1;k<events.size();k++)
+					{
+						if(events[k]!=nullptr)
+						{
+							clWaitForEvents(1,&events[k]);
+							clReleaseEvent(events[k]);
+						}
+					}
+					throw;
+				}
+			}
+		}
+	}
+
+	// index of the lock of the cache shard that serves a page
+	static size_t lockIndexOf(const size_t & selectedPage, const size_t & nVirtualArray, const size_t & nShard) noexcept
+	{
+		const size_t selectedVirtualArray = selectedPage%nVirtualArray;
+		const size_t numInterleave = selectedPage/nVirtualArray;
+		return selectedVirtualArray*nShard + (numInterleave%nShard);
+	}
+
+	// lock of the cache shard that serves a page
+	LMutex & lockOfPage(const size_t & selectedPage) const
+	{
+		return pageLock.get()[lockIndexOf(selectedPage,numDevice,numShard)];
+	}
+
+	// exclusive ownership of all cache shards of a virtual gpu, always locked in same order
+	std::deque<LExclusiveLock> lockAllShards(const size_t selectedVirtualArray) const
+	{
+		std::deque<LExclusiveLock> result;
+		for(size_t i=0;i<numShard;i++)
+		{
+			result.emplace_back(pageLock.get()[selectedVirtualArray*numShard + i]);
+		}
+		return result;
+	}
 };
 
 
@@ -0,0 +1,100 @@
+/*
+ * VramSnapshot.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: tugrul
+ */
+
+#ifndef VRAMSNAPSHOT_H_
+#define VRAMSNAPSHOT_H_
+
+#include<map>
+#include<mutex>
+#include<vector>
+#include<memory>
+#include<algorithm>
+#include<stdexcept>
+#include<CL/cl.h>
+#include"ClArray.h"
+#include"ClCommandQueue.h"
+
+// copy-on-write state of vram of a virtual gpu while VirtualMultiArray::snapshot() saves it
+// snapshot saves frozen pages in increasing order, pages below nextPage are saved
+// a page that is going to be overwritten before it is saved is read from vram first and kept here until snapshot takes it
+// preserve() is called under lock of at least one cache shard of the virtual gpu, save() under locks of all of its shards
+template<typename T>
+class VramSnapshot
+{
+public:
+	// cq: in-order queue of virtual gpu (copies are read on it, so they come after earlier writes of the queue)
+	// arr: vram buffer of virtual gpu
+	// pageSize: number of elements per frozen page
+	VramSnapshot(std::shared_ptr<ClCommandQueue> cq, std::shared_ptr<ClArray<T>> arr, const size_t pageSize):q(cq),gpu(arr),szp(pageSize),nextPage(0){}
+
+	// called before frozen pages [firstPage,lastPage] are written in vram (returns after their copies are complete)
+	// consecutive pages that are not saved and not preserved yet are read together
+	void preserve(const size_t firstPage, const size_t lastPage)
+	{
+		if(lastPage<nextPage)
+		{
+			return;
+		}
+
+		std::unique_lock<std::mutex> lck(m);
+		size_t p = std::max(firstPage,nextPage);
+		while(p<=lastPage)
+		{
+			if(preserved.find(p)!=preserved.end())
+			{
+				p++;
+				continue;
+			}
+
+			size_t runEnd = p+1;
+			while((runEnd<=lastPage) && (preserved.find(runEnd)==preserved.end()))
+			{
+				runEnd++;
+			}
+
+			std::vector<T> run((runEnd-p)*szp);
+			cl_int err = clEnqueueReadBuffer(q->getQueue(), gpu->getMem(), CL_TRUE, sizeof(T) * p * szp, sizeof(T) * run.size(), run.data(), 0, nullptr, nullptr);
+			if(CL_SUCCESS != err)
+			{
+				throw std::invalid_argument("error: snapshot copy-on-write read buffer");
+			}
+
+			for(size_t k=p;k<runEnd;k++)
+			{
+				preserved.emplace(k,std::vector<T>(run.begin() + (k-p)*szp, run.begin() + (k-p+1)*szp));
+			}
+			p = runEnd;
+		}
+	}
+
+	// called after frozen pages [firstPage,lastPage] are read from vram into host (page k at host + (k-firstPage)*hostPitch)
+	// preserved pages replace what was read, then pages are saved and their copies are released
+	void save(const size_t firstPage, const size_t lastPage, T * const host, const size_t hostPitch)
+	{
+		std::unique_lock<std::mutex> lck(m);
+		auto it = preserved.lower_bound(firstPage);
+		while((it!=preserved.end()) && (it->first<=lastPage))
+		{
+			std::copy(it->second.begin(), it->second.end(), host + (it->first-firstPage)*hostPitch);
+			it = preserved.erase(it);
+		}
+		nextPage = lastPage+1;
+	}
+private:
+	std::shared_ptr<ClCommandQueue> q;
+	std::shared_ptr<ClArray<T>> gpu;
+	size_t szp;
+
+	// changed only by save(), while no preserve() can run
+	size_t nextPage;
+
+	// preserve() calls of different shards can run concurrently
+	std::mutex m;
+	std::map<size_t,std::vector<T>> preserved;
+};
+
+#endif /* VRAMSNAPSHOT_H_ */
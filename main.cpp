@@ -93,6 +93,24 @@ int main(int argC, char** argV)
 	}
 
 
+	// pages of first 10000 elements are already cached, this measures only the cache-hit path (lock + page lookup + copy)
+	for (int j = 0; j < 5; j++)
+	{
+		const size_t hitIterations = 10000000;
+		size_t checksum = 0;
+		{
+			CpuBenchmarker bench(hitIterations*sizeof(Particle), "single threaded ---get---, cache hit path", hitIterations);
+			for (size_t i = 0; i < hitIterations; i++)
+			{
+				checksum += test.get(i % 10000).getId();
+			}
+		}
+		if (checksum == 0)
+		{
+			std::cout << "Error!" << std::endl;
+		}
+	}
+
 	{
 		CpuBenchmarker bench(n*sizeof(Particle), "multithreaded sequential set",n);
 		#pragma omp parallel for schedule(guided)